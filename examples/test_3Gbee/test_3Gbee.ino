@@ -38,6 +38,7 @@
 #define TEST_HTTP
 //#define TEST_FTP
 //#define TEST_SMS
+//#define TEST_RESPONSE_TIME
 
 void printToLen(const char* buffer, size_t len)
 {
@@ -187,6 +188,19 @@ void setup()
         }
 #endif
 
+#ifdef TEST_RESPONSE_TIME
+        {
+            // Measure the round trip of a simple command
+            sodaq_3gbee.resetResponseTimes();
+            for (uint8_t i = 0; i < 20; i++) {
+                sodaq_3gbee.getNetworkStatus();
+            }
+            MySerial.print("Average response time: ");
+            MySerial.print(sodaq_3gbee.getAverageResponseTime());
+            MySerial.println(" ms");
+        }
+#endif
+
 #ifdef TEST_SIM_DEVICE_INFO
         {
             char numberBuffer[16];
@@ -1,5 +1,6 @@
 #include <Arduino.h>
 #include <Sodaq_wdt.h>
+#include <limits.h>
 
 #include "Sodaq_3Gbee.h"
 
@@ -31,19 +32,36 @@
 #ifdef DEBUG
 #define debugPrintLn(...) { if (!this->_disableDiag && this->_diagStream) this->_diagStream->println(__VA_ARGS__); }
 #define debugPrint(...) { if (!this->_disableDiag && this->_diagStream) this->_diagStream->print(__VA_ARGS__); }
+// For use in the static (URC handler) methods
+#define debugPrintLnTo(obj, ...) { if (!(obj)->_disableDiag && (obj)->_diagStream) (obj)->_diagStream->println(__VA_ARGS__); }
+#define debugPrintTo(obj, ...) { if (!(obj)->_disableDiag && (obj)->_diagStream) (obj)->_diagStream->print(__VA_ARGS__); }
 #warning "Debug mode is ON"
 #else
 #define debugPrintLn(...)
 #define debugPrint(...)
+#define debugPrintLnTo(obj, ...)
+#define debugPrintTo(obj, ...)
 #endif
 
 #define BLOCK_TIMEOUT -1
 #define DEFAULT_PROFILE "0"
 #define HIGH_BAUDRATE 57600
-#define MAX_SOCKET_BUFFER 512
+#define MAX_SOCKET_READ_BINARY 1024
+#define MAX_SOCKET_READ_HEX 512
+#define MAX_SOCKET_WRITE 1024
+#define DEFAULT_SOCKET_WRITE_BUFFER_SIZE 256
+#define SOCKET_OUTPUT_SAMPLE_INTERVAL 100
 #define HTTP_SEND_TMP_FILENAME "http_tmp_put_0"
 #define HTTP_RECEIVE_FILENAME "http_last_response_0"
+#define HTTP_HEADER_BLOCK_SIZE 256
+#define HTTP_HEADER_LINE_SIZE 128
 #define FTP_TMP_FILENAME "ftp_tmp_file"
+#define PSD_AUTH_FILENAME "psd_auth"
+#define FTP_RECEIVE_FILENAME "ftp_rx_file"
+#define FTP_RECEIVE_TIMEOUT 300000
+#define NETWORK_STATUS_QUERY_INTERVAL 1000
+#define OPERATOR_SURVEY_SAMPLE_INTERVAL 1000
+#define POLL_IDLE_DELAY 5
 #define CTRL_Z '\x1A'
 
 #define NOW (uint32_t)millis()
@@ -54,6 +72,110 @@ static inline bool is_timedout(uint32_t from, uint32_t nr_ms)
     return (millis() - from) > nr_ms;
 }
 
+/*
+ * Parse a comma separated list of integers, such as the parameters of a URC.
+ * Spaces around the values are skipped.
+ *
+ * Returns the number of values parsed. It stops at the first field which is
+ * not a number.
+ */
+static size_t parse_int_list(const char* str, int* values, size_t count)
+{
+    size_t nr = 0;
+    while (nr < count) {
+        while (*str == ' ') {
+            str++;
+        }
+        bool negative = (*str == '-');
+        if (negative) {
+            str++;
+        }
+        if (*str < '0' || *str > '9') {
+            break;
+        }
+        int value = 0;
+        while (*str >= '0' && *str <= '9') {
+            value = value * 10 + (*str - '0');
+            str++;
+        }
+        values[nr++] = negative ? -value : value;
+
+        while (*str == ' ') {
+            str++;
+        }
+        if (*str != ',') {
+            break;
+        }
+        str++;
+    }
+
+    return nr;
+}
+
+// Converts the <stat> of +CREG / +CGREG.
+static NetworkRegistrationStatuses convert_network_status(int stat)
+{
+    switch (stat) {
+        case 0: return NoNetworkRegistrationStatus;
+        case 1: return Home;
+        case 2: return NoNetworkRegistrationStatus;
+        case 3: return Denied;
+        case 4: return UnknownNetworkRegistrationStatus;
+        case 5: return Roaming;
+        default: return Denied; // rest of statuses are actually registered, but they do not support data
+    }
+}
+
+// Returns true if the status is a registration (home or roaming).
+static bool is_registered(NetworkRegistrationStatuses status)
+{
+    return (status == Home || status == Roaming);
+}
+
+// Converts the <AcT> of +COPS / +CREG / +CGREG.
+static NetworkTechnologies convert_network_technology(int act)
+{
+    switch (act) {
+        case 0: return GSM;
+        case 1: return GSM;
+        case 2: return UTRAN;
+        case 3: return EDGE;
+        case 4: return HSDPA;
+        case 5: return HSUPA;
+        case 6: return HSDPAHSUPA;
+        case 7: return LTE;
+        default: return UnknownNetworkTechnology;
+    }
+}
+
+/*
+ * Parse the parameters of a +CREG / +CGREG URC (<n>=2):
+ *     <stat>[,"<lac>","<ci>"[,<AcT>[,...]]]
+ *
+ * The response to AT+CREG? starts with <n>,<stat> instead, it is not a URC.
+ * The values which are not present are left untouched.
+ *
+ * Returns false if it is not a URC.
+ */
+static bool parse_registration_urc(const char* str, int* stat, uint16_t* lac, uint32_t* cellId, int* act)
+{
+    int values[2];
+    if (parse_int_list(str, values, 2) != 1) {
+        return false;
+    }
+    *stat = values[0];
+
+    unsigned int lacValue;
+    unsigned long cellIdValue;
+    int fields = sscanf(str, "%*d,\"%x\",\"%lx\",%d", &lacValue, &cellIdValue, act);
+    if (fields >= 2) {
+        *lac = lacValue;
+        *cellId = cellIdValue;
+    }
+
+    return true;
+}
+
 
 // A specialized class to switch on/off the 3Gbee module
 // The VCC3.3 pin is switched by the Autonomo BEE_VCC pin
@@ -82,16 +204,68 @@ Sodaq_3Gbee sodaq_3gbee;
 Sodaq_3Gbee::Sodaq_3Gbee()
 {
     _psdAuthType = PAT_None;
-    ftpDirectoryChangeCounter = 0;
+    _psdAuthLoadCallback = NULL;
+    _psdAuthSaveCallback = NULL;
+    _psdAuthStorageParameter = NULL;
+    ftpPath[0] = '\0';
+    ftpReceiveCached = false;
     _openTCPsocket = -1;
-    _httpGetHeaderSize = 0;
+    resetSockets();
+    _httpResponseParsed = TriBoolUndefined;
+    _httpProfileHost = NULL;
+    _httpProfilePort = 0;
+    _httpProfilePowerCycle = 0;
+    _httpContentType = HttpContentTextPlain;
     _timeToSocketConnect = 0;
     _timeToSocketClose = 0;
-    _host_ip = NO_IP_ADDRESS;
-    _host_name[0] = 0;
+    clearCachedHostIp();
+    _dnsCacheTtl = DEFAULT_DNS_CACHE_TTL;
+    _dnsCacheFailureTtl = DEFAULT_DNS_CACHE_FAILURE_TTL;
+    _dnsCacheUseCount = 0;
+    _preresolveHosts = NULL;
+    _preresolveHostCount = 0;
     _echoOff = false;
     _flushEverySend = false;
+    _socketBinaryMode = false;
+    _warmConnect = false;
+    _mqttPacketBuffering = false;
+    _writeBuffer = NULL;
+    _writeBufferSize = DEFAULT_SOCKET_WRITE_BUFFER_SIZE;
+    _writeBufferCount = 0;
+    _writeBufferSocket = 0;
+    _outputSampleSocket = 0;
+    _outputSampleValue = 0;
+    _lastOutputSample = 0;
     _foundUUPSDD = false;
+    resetNetworkInfo();
+    _registrationUrcEnabled = false;
+    _operatorSurveyCount = 0;
+    _asyncPending = false;
+    _asyncParserMethod = 0;
+    _asyncCallbackParameter = 0;
+    _asyncCallbackParameter2 = 0;
+    _asyncCompletionCallback = 0;
+    _asyncCompletionParameter = 0;
+    _asyncStart = 0;
+    _asyncTimeout = 0;
+    _asyncResponse = ResponseNotFound;
+    _asyncResult = ResponseNotFound;
+    _lastResponseTime = 0;
+    _responseTimeTotal = 0;
+    _responseCount = 0;
+
+    _urcHandlerCount = 0;
+    setUrcHandler("+UUSORD:", _uusordUrcHandler, this);
+    setUrcHandler("+UUSORF:", _uusordUrcHandler, this);
+    setUrcHandler("+UUSOCL:", _uusoclUrcHandler, this);
+    setUrcHandler("+UUHTTPCR:", _uuhttpcrUrcHandler, this);
+    setUrcHandler("+UUFTPCR:", _uuftpcrUrcHandler, this);
+    setUrcHandler("+UUPSDD:", _uupsddUrcHandler, this);
+    setUrcHandler("+CREG:", _cregUrcHandler, this);
+    setUrcHandler("+CGREG:", _cgregUrcHandler, this);
+    // ignore the Network Selection Control +PACSP URC
+    setUrcHandler("+PACSP", _ignoreUrcHandler, NULL);
+    _urcBuiltinCount = _urcHandlerCount;
 }
 
 bool Sodaq_3Gbee::startsWith(const char* pre, const char* str)
@@ -102,12 +276,13 @@ bool Sodaq_3Gbee::startsWith(const char* pre, const char* str)
 /*!
  * Read the next response from the modem
  *
- * Notice that we're collecting URC's here. And in the process we could
- * be updating:
- *     _socketPendingBytes[] if +UUSORD: is seen
- *     _socketClosedBit[] if +UUSOCL: is seen
+ * Notice that we're collecting URC's here (see dispatchUrc()). And in the
+ * process we could be updating:
+ *     _sockets[].pendingBytes if +UUSORD: is seen
+ *     _sockets[].closed if +UUSOCL: is seen
  *     _httpRequestSuccessBit[] if +UUHTTPCR: is seen
  *     ftpCommandURC[] if +UUFTPCR: is seen
+ *     _networkInfo if +CREG: or +CGREG: is seen
  */
 ResponseTypes Sodaq_3Gbee::readResponse(char* buffer, size_t size,
         CallbackMethodPtr parserMethod, void* callbackParameter, void* callbackParameter2,
@@ -117,152 +292,515 @@ ResponseTypes Sodaq_3Gbee::readResponse(char* buffer, size_t size,
     uint32_t from = NOW;
 
     do {
-        // 250ms,  how many bytes at which baudrate?
-        int count = readLn(buffer, size, 250);
+        // This returns as soon as a complete line has arrived, the 250ms
+        // is just the longest wait before the watchdog is reset.
+        char* line;
+        size_t count;
+        bool found = readLnView(line, count, 250, STR_RESPONSE_SOCKET_PROMPT STR_RESPONSE_SMS_PROMPT);
         sodaq_wdt_reset();
         
-        if (count > 0) {
+        if (found && count > 0) {
+            if (buffer != _inputBuffer) {
+                // The line is in the input buffer, copy it to the requested buffer
+                if (count > size - 1) {
+                    count = size - 1;
+                }
+                memcpy(buffer, line, count);
+                buffer[count] = '\0';
+                line = buffer;
+            }
             if (outSize) {
                 *outSize = count;
             }
-            if (_disableDiag && strncmp(buffer, "OK", 2) != 0) {
-                _disableDiag = false;
-            }
 
-            debugPrint("[rdResp]: ");
-            debugPrintLn(buffer);
-
-            // handle unsolicited codes
-
-            int param1, param2;
-            if (sscanf(buffer, "+UUSORD: %d,%d", &param1, &param2) == 2) {
-                uint16_t socket_nr = param1;
-                uint16_t nr_bytes = param2;
-                debugPrint("Unsolicited: Socket ");
-                debugPrint(socket_nr);
-                debugPrint(": ");
-                debugPrint(param2);
-                debugPrintLn(" bytes pending");
-                if (socket_nr < ARRAY_SIZE(_socketPendingBytes)) {
-                    _socketPendingBytes[socket_nr] = nr_bytes;
-                }
-                continue;
-            }
-            else if (sscanf(buffer, "+UUSOCL: %d", &param1) == 1) {
-                uint16_t socket_nr = param1;
-                if (socket_nr < ARRAY_SIZE(_socketPendingBytes)) {
-                    debugPrint("Unsolicited: Socket ");
-                    debugPrint(socket_nr);
-                    debugPrint(": ");
-                    debugPrintLn("closed by remote");
-
-                    _socketClosedBit[socket_nr] = true;
-                    if (socket_nr == _openTCPsocket) {
-                        _openTCPsocket = -1;
-                        // Report this other software layers
-                        if (_tcpClosedHandler) {
-                            _tcpClosedHandler();
-                        }
-                    }
-                }
-                continue;
-            }
-            else if (sscanf(buffer, "+UUHTTPCR: 0, %d, %d", &param1, &param2) == 2) {
-                int requestType = _httpModemIndexToRequestType(static_cast<uint8_t>(param1));
-                if (requestType >= 0) {
-                    debugPrint("HTTP Result for request type ");
-                    debugPrint(requestType);
-                    debugPrint(": ");
-                    debugPrintLn(param2);
-
-                    if (param2 == 0) {
-                        _httpRequestSuccessBit[requestType] = TriBoolFalse;
-                    }
-                    else if (param2 == 1) {
-                        _httpRequestSuccessBit[requestType] = TriBoolTrue;
-                    }
-                } else {
-                    // Unknown type
-                }
-                continue;
-            }
-            else if (sscanf(buffer, "+UUFTPCR: %d, %d", &param1, &param2) == 2) {
-                debugPrint("FTP Result for command ");
-                debugPrint(param1);
-                debugPrint(": ");
-                debugPrintLn(param2);
-
-                ftpCommandURC[0] = static_cast<uint8_t>(param1);
-                ftpCommandURC[1] = static_cast<uint8_t>(param2);
-                continue;
-            }
-            else if (sscanf(buffer, "+UUPSDD: %d", &param1) == 1) {
-                debugPrint("UUPSDD profile: ");
-                debugPrintLn(param1);
-                // Ignore profile
-                _foundUUPSDD = true;
-                continue;
+            ResponseTypes lineResponse = handleResponseLine(line, count, parserMethod,
+                    callbackParameter, callbackParameter2, response);
+            if (lineResponse != ResponseNotFound) {
+                recordResponseTime();
+                return lineResponse;
             }
+        }
+    } while (!is_timedout(from, timeout));
 
-            // ignore the Network Selection Control +PACSP URC
-            if (startsWith("+PACSP", buffer)) {
-              continue;
-            }
+    if (outSize) {
+        *outSize = 0;
+    }
 
-            if (startsWith(STR_AT, buffer)) {
-                continue; // skip echoed back command
-            }
-            
-            _disableDiag = false;
-            if (startsWith(STR_RESPONSE_OK, buffer)) {
-                return ResponseOK;
-            }
-            
-            if (startsWith(STR_RESPONSE_ERROR, buffer) ||
-                    startsWith(STR_RESPONSE_CME_ERROR, buffer) ||
-                    startsWith(STR_RESPONSE_CMS_ERROR, buffer)) {
-                return ResponseError;
-            }
-            
-            if (startsWith(STR_RESPONSE_SOCKET_PROMPT, buffer) ||
-                    startsWith(STR_RESPONSE_SMS_PROMPT, buffer) ||
-                    startsWith(STR_RESPONSE_FILE_PROMPT, buffer)) {
-                return ResponsePrompt;
-            }
+    debugPrintLn("[rdResp]: timed out");
+    return ResponseTimeout;
+}
 
-            if (parserMethod) {
-                ResponseTypes parserResponse = parserMethod(response, buffer, count, callbackParameter, callbackParameter2);
-                if (parserResponse != ResponseEmpty) {
-                    return parserResponse;
-                } else {
-                    // ?
-                    // ResponseEmpty indicates that the parser was satisfied
-                    // Continue until "OK", "ERROR", or whatever else.
-                }
-                // Prevent calling the parser again.
-                // This could happen if the input line is too long. It will be split
-                // and the next readLn will return the next part.
-                parserMethod = 0;
+/*!
+ * Handle a single line read from the modem
+ *
+ * URC's are consumed here (see readResponse()), the other lines are checked
+ * for the final result codes and passed to the parser method.
+ * The parserMethod is cleared after it has been called once.
+ *
+ * Returns ResponseNotFound if more lines are needed to complete the response.
+ */
+ResponseTypes Sodaq_3Gbee::handleResponseLine(char* buffer, size_t count, CallbackMethodPtr& parserMethod,
+        void* callbackParameter, void* callbackParameter2, ResponseTypes& response)
+{
+    if (_disableDiag && strncmp(buffer, "OK", 2) != 0) {
+        _disableDiag = false;
+    }
+
+    debugPrint("[rdResp]: ");
+    debugPrintLn(buffer);
+
+    // handle unsolicited codes
+    if (buffer[0] == '+' && dispatchUrc(buffer, count)) {
+        return ResponseNotFound;
+    }
+
+    if (startsWith(STR_AT, buffer)) {
+        return ResponseNotFound; // skip echoed back command
+    }
+
+    _disableDiag = false;
+    if (startsWith(STR_RESPONSE_OK, buffer)) {
+        return ResponseOK;
+    }
+
+    if (startsWith(STR_RESPONSE_ERROR, buffer) ||
+            startsWith(STR_RESPONSE_CME_ERROR, buffer) ||
+            startsWith(STR_RESPONSE_CMS_ERROR, buffer)) {
+        return ResponseError;
+    }
+
+    if (startsWith(STR_RESPONSE_SOCKET_PROMPT, buffer) ||
+            startsWith(STR_RESPONSE_SMS_PROMPT, buffer) ||
+            startsWith(STR_RESPONSE_FILE_PROMPT, buffer)) {
+        return ResponsePrompt;
+    }
+
+    if (parserMethod) {
+        ResponseTypes parserResponse = parserMethod(response, buffer, count, callbackParameter, callbackParameter2);
+        if (parserResponse != ResponseEmpty) {
+            return parserResponse;
+        } else {
+            // ?
+            // ResponseEmpty indicates that the parser was satisfied
+            // Continue until "OK", "ERROR", or whatever else.
+        }
+        // Prevent calling the parser again.
+        // This could happen if the input line is too long. It will be split
+        // and the next readLn will return the next part.
+        parserMethod = 0;
+    }
+
+    // at this point, the parserMethod has ran and there is no override response from it, 
+    // so if there is some other response recorded, return that
+    // (otherwise continue iterations until timeout)
+    if (response != ResponseNotFound) {
+        debugPrintLn("** response != ResponseNotFound");
+        return response;
+    }
+
+    return ResponseNotFound;
+}
+
+/*!
+ * Register a handler for the URC with the given prefix
+ *
+ * The prefix must be a static string, only the pointer is stored. Registering
+ * the same prefix again replaces the handler, a NULL handler removes it.
+ * The built-in handlers cannot be replaced.
+ *
+ * Returns false if the prefix is invalid or the table is full.
+ */
+bool Sodaq_3Gbee::setUrcHandler(const char* prefix, UrcHandlerPtr handler, void* parameter)
+{
+    // Each URC starts with a '+', see dispatchUrc()
+    if (!prefix || prefix[0] != '+' || prefix[1] == '\0') {
+        return false;
+    }
+
+    for (size_t i = 0; i < _urcHandlerCount; i++) {
+        if (strcmp(_urcHandlers[i].prefix, prefix) != 0) {
+            continue;
+        }
+        if (i < _urcBuiltinCount) {
+            return false;
+        }
+        if (handler) {
+            _urcHandlers[i].handler = handler;
+            _urcHandlers[i].parameter = parameter;
+        } else {
+            // Remove it, moving the last one into its place
+            _urcHandlers[i] = _urcHandlers[--_urcHandlerCount];
+        }
+        return true;
+    }
+
+    if (!handler) {
+        return true;
+    }
+    if (_urcHandlerCount >= ARRAY_SIZE(_urcHandlers)) {
+        debugPrintLn(DEBUG_STR_ERROR "The URC handler table is full!");
+        return false;
+    }
+
+    UrcHandler_t& entry = _urcHandlers[_urcHandlerCount++];
+    entry.prefix = prefix;
+    entry.prefixLen = strlen(prefix);
+    entry.handler = handler;
+    entry.parameter = parameter;
+
+    return true;
+}
+
+/*!
+ * Pass the line to the handler of the matching URC, if any
+ *
+ * The second character of the prefix is compared first, which is cheap and
+ * rules out most of the entries before doing the string compare.
+ *
+ * Returns true if the line was handled as a URC.
+ */
+bool Sodaq_3Gbee::dispatchUrc(const char* buffer, size_t size)
+{
+    char c = buffer[1];
+    for (size_t i = 0; i < _urcHandlerCount; i++) {
+        const UrcHandler_t& entry = _urcHandlers[i];
+        if (entry.prefix[1] != c || size < entry.prefixLen
+                || strncmp(buffer, entry.prefix, entry.prefixLen) != 0) {
+            continue;
+        }
+
+        // Skip the spaces following the prefix
+        const char* params = buffer + entry.prefixLen;
+        while (*params == ' ') {
+            params++;
+        }
+        return entry.handler(params, size - (params - buffer), entry.parameter);
+    }
+
+    return false;
+}
+
+// +UUSORD: <socket>,<length>
+// +UUSORF: <socket>,<length>
+bool Sodaq_3Gbee::_uusordUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    int values[2];
+    if (parse_int_list(buffer, values, 2) != 2) {
+        return false;
+    }
+
+    uint16_t socket_nr = values[0];
+    uint16_t nr_bytes = values[1];
+    debugPrintTo(modem, "Unsolicited: Socket ");
+    debugPrintTo(modem, socket_nr);
+    debugPrintTo(modem, ": ");
+    debugPrintTo(modem, nr_bytes);
+    debugPrintLnTo(modem, " bytes pending");
+    if (socket_nr < ARRAY_SIZE(modem->_sockets)) {
+        modem->_sockets[socket_nr].pendingBytes = nr_bytes;
+    }
+
+    return true;
+}
+
+// +UUSOCL: <socket>
+bool Sodaq_3Gbee::_uusoclUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    int socket;
+    if (parse_int_list(buffer, &socket, 1) != 1) {
+        return false;
+    }
+
+    uint16_t socket_nr = socket;
+    if (socket_nr < ARRAY_SIZE(modem->_sockets)) {
+        debugPrintTo(modem, "Unsolicited: Socket ");
+        debugPrintTo(modem, socket_nr);
+        debugPrintTo(modem, ": ");
+        debugPrintLnTo(modem, "closed by remote");
+
+        modem->_sockets[socket_nr].closed = true;
+        modem->_sockets[socket_nr].state = SocketFree;
+        modem->_sockets[socket_nr].drainedCallback = NULL;
+        modem->discardSocketWrites(socket_nr);
+        if (socket_nr == modem->_openTCPsocket) {
+            modem->_openTCPsocket = -1;
+            // Report this other software layers
+            if (modem->_tcpClosedHandler) {
+                modem->_tcpClosedHandler();
             }
+        }
+    }
+
+    return true;
+}
+
+// +UUHTTPCR: <profile>,<http_command>,<http_result>
+bool Sodaq_3Gbee::_uuhttpcrUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    int values[3];
+    if (parse_int_list(buffer, values, 3) != 3 || values[0] != 0) {
+        return false;
+    }
+
+    int requestType = _httpModemIndexToRequestType(static_cast<uint8_t>(values[1]));
+    if (requestType >= 0) {
+        debugPrintTo(modem, "HTTP Result for request type ");
+        debugPrintTo(modem, requestType);
+        debugPrintTo(modem, ": ");
+        debugPrintLnTo(modem, values[2]);
+
+        if (values[2] == 0) {
+            modem->_httpRequestSuccessBit[requestType] = TriBoolFalse;
+        }
+        else if (values[2] == 1) {
+            modem->_httpRequestSuccessBit[requestType] = TriBoolTrue;
+        }
+    } else {
+        // Unknown type
+    }
+
+    return true;
+}
+
+// +UUFTPCR: <op_code>,<ftp_result>
+bool Sodaq_3Gbee::_uuftpcrUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    int values[2];
+    if (parse_int_list(buffer, values, 2) != 2) {
+        return false;
+    }
+
+    debugPrintTo(modem, "FTP Result for command ");
+    debugPrintTo(modem, values[0]);
+    debugPrintTo(modem, ": ");
+    debugPrintLnTo(modem, values[1]);
+
+    modem->ftpCommandURC[0] = static_cast<uint8_t>(values[0]);
+    modem->ftpCommandURC[1] = static_cast<uint8_t>(values[1]);
+
+    return true;
+}
+
+// +UUPSDD: <profile>
+bool Sodaq_3Gbee::_uupsddUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    int profile;
+    if (parse_int_list(buffer, &profile, 1) != 1) {
+        return false;
+    }
+
+    debugPrintTo(modem, "UUPSDD profile: ");
+    debugPrintLnTo(modem, profile);
+    // Ignore profile
+    modem->_foundUUPSDD = true;
+    modem->resetSockets();
+
+    // The MQTT socket is gone too
+    if (modem->_openTCPsocket >= 0) {
+        modem->_openTCPsocket = -1;
+        // Report this other software layers
+        if (modem->_tcpClosedHandler) {
+            modem->_tcpClosedHandler();
+        }
+    }
+
+    return true;
+}
+
+// +CREG: <stat>[,<lac>,<ci>[,<AcT>]]
+bool Sodaq_3Gbee::_cregUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    NetworkRegistrationInfo_t& info = modem->_networkInfo;
+    int stat;
+    int act = -1;
+    if (!parse_registration_urc(buffer, &stat, &info.lac, &info.cellId, &act)) {
+        // The response to AT+CREG?, for the parser
+        return false;
+    }
+
+    debugPrintTo(modem, "Network registration: ");
+    debugPrintLnTo(modem, stat);
 
-            // at this point, the parserMethod has ran and there is no override response from it, 
-            // so if there is some other response recorded, return that
-            // (otherwise continue iterations until timeout)
-            if (response != ResponseNotFound) {
-                debugPrintLn("** response != ResponseNotFound");
-                return response;
+    NetworkRegistrationStatuses status = convert_network_status(stat);
+    if (status != info.status) {
+        info.status = status;
+        info.changedAt = NOW;
+    }
+    if (act >= 0) {
+        info.technology = convert_network_technology(act);
+    }
+
+    return true;
+}
+
+// +CGREG: <stat>[,<lac>,<ci>[,<AcT>,<rac>]]
+bool Sodaq_3Gbee::_cgregUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    NetworkRegistrationInfo_t& info = modem->_networkInfo;
+    int stat;
+    int act = -1;
+    if (!parse_registration_urc(buffer, &stat, &info.lac, &info.cellId, &act)) {
+        return false;
+    }
+
+    debugPrintTo(modem, "GPRS registration: ");
+    debugPrintLnTo(modem, stat);
+
+    NetworkRegistrationStatuses status = convert_network_status(stat);
+    if (status != info.gprsStatus) {
+        info.gprsStatus = status;
+        info.changedAt = NOW;
+    }
+    if (act >= 0) {
+        info.technology = convert_network_technology(act);
+    }
+
+    return true;
+}
+
+bool Sodaq_3Gbee::_ignoreUrcHandler(const char* buffer, size_t size, void* parameter)
+{
+    return true;
+}
+
+// Records the time between sending the most recent command and its response.
+// Only the first final response counts, e.g. not the OK after a prompt.
+void Sodaq_3Gbee::recordResponseTime()
+{
+    if (!_commandOutstanding) {
+        return;
+    }
+    _commandOutstanding = false;
+
+    _lastResponseTime = NOW - _commandSentAt;
+    _responseTimeTotal += _lastResponseTime;
+    _responseCount++;
+}
+
+// Sends the given command and returns immediately, the response is handled by poll().
+// Returns false if another asynchronous command is still pending.
+bool Sodaq_3Gbee::sendCommandAsync(const char* command, uint32_t timeout,
+        CallbackMethodPtr parserMethod, void* callbackParameter, void* callbackParameter2,
+        AsyncCommandCallbackPtr completionCallback, void* completionParameter)
+{
+    if (_asyncPending) {
+        debugPrintLn(DEBUG_STR_ERROR "An asynchronous command is still pending!");
+        return false;
+    }
+
+    // Handle what is already there, so it won't be taken as the response
+    pollInput();
+
+    _asyncParserMethod = parserMethod;
+    _asyncCallbackParameter = callbackParameter;
+    _asyncCallbackParameter2 = callbackParameter2;
+    _asyncCompletionCallback = completionCallback;
+    _asyncCompletionParameter = completionParameter;
+    _asyncResponse = ResponseNotFound;
+    _asyncResult = ResponseNotFound;
+    _asyncTimeout = timeout;
+    _asyncStart = NOW;
+
+    // Set after the command is written, see beforeCommand()
+    println(command);
+    _asyncPending = true;
+
+    return true;
+}
+
+/*!
+ * Handle whatever the modem has sent so far, without blocking
+ *
+ * The lines are handled in the same way as readResponse() does. So URC's are
+ * collected, and the response of the pending asynchronous command (if any) is
+ * checked for its final result.
+ *
+ * Returns the final response of the asynchronous command if it completed
+ * during this call, ResponseNotFound otherwise.
+ */
+ResponseTypes Sodaq_3Gbee::poll()
+{
+    ResponseTypes result = pollInput();
+
+    if (!_asyncPending) {
+        sampleSocketOutput();
+    }
+
+    return result;
+}
+
+ResponseTypes Sodaq_3Gbee::pollInput()
+{
+    ResponseTypes result = ResponseNotFound;
+    char* line;
+    size_t count;
+
+    while (pollLn(line, count)) {
+        if (count == 0) {
+            continue;
+        }
+
+        if (_asyncPending) {
+            ResponseTypes lineResponse = handleResponseLine(line, count, _asyncParserMethod,
+                    _asyncCallbackParameter, _asyncCallbackParameter2, _asyncResponse);
+            if (lineResponse != ResponseNotFound) {
+                result = lineResponse;
+                finishAsyncCommand(result);
             }
+        } else {
+            // Only interested in the URC's
+            CallbackMethodPtr noParser = 0;
+            ResponseTypes noResponse = ResponseNotFound;
+            handleResponseLine(line, count, noParser, NULL, NULL, noResponse);
         }
+    }
 
-        delay(10);      // TODO Why do we need this delay?
-    } while (!is_timedout(from, timeout));
+    if (_asyncPending && is_timedout(_asyncStart, _asyncTimeout)) {
+        debugPrintLn("[poll]: timed out");
+        result = ResponseTimeout;
+        finishAsyncCommand(result);
+    }
 
-    if (outSize) {
-        *outSize = 0;
+    return result;
+}
+
+void Sodaq_3Gbee::pollIdle()
+{
+    if (fillInputBuffer() == 0) {
+        delay(POLL_IDLE_DELAY);
     }
 
-    debugPrintLn("[rdResp]: timed out");
-    return ResponseTimeout;
+    // Not poll(), the socket output is only sampled when the application polls
+    pollInput();
+}
+
+void Sodaq_3Gbee::beforeCommand()
+{
+    while (_asyncPending) {
+        pollInput();
+        sodaq_wdt_reset();
+    }
+}
+
+void Sodaq_3Gbee::finishAsyncCommand(ResponseTypes result)
+{
+    _asyncPending = false;
+    _asyncResult = result;
+    _asyncParserMethod = 0;
+    if (result != ResponseTimeout) {
+        recordResponseTime();
+    }
+
+    if (_asyncCompletionCallback) {
+        _asyncCompletionCallback(result, _asyncCompletionParameter);
+    }
 }
 
 bool Sodaq_3Gbee::setSimPin(const char* simPin)
@@ -308,8 +846,8 @@ bool Sodaq_3Gbee::waitForFtpCommandResult(uint8_t ftpCommandIndex, uint32_t time
     ftpCommandURC[0] = 0xFF; // set to unused value to clear (0 is used)
     ftpCommandURC[1] = 0;
     while (ftpCommandURC[0] != ftpCommandIndex && !is_timedout(start, timeout)) {
-        isAlive();
-        delay(5);
+        pollIdle();
+        sodaq_wdt_reset();
     }
 
     return (ftpCommandURC[0] == ftpCommandIndex) && (ftpCommandURC[1] == 1);
@@ -325,30 +863,110 @@ bool Sodaq_3Gbee::changeFtpDirectory(const char* directory)
         return false;
     }
 
-    if (strcmp("..", directory)) {
-        ftpDirectoryChangeCounter--;
+    if (strcmp("..", directory) == 0) {
+        char* last = strrchr(ftpPath, '/');
+        if (last) {
+            *last = '\0';
+        }
+        else {
+            ftpPath[0] = '\0';
+        }
     }
     else {
-        ftpDirectoryChangeCounter++;
+        // setFtpPath() has checked that it fits
+        if (ftpPath[0] != '\0') {
+            strcat(ftpPath, "/");
+        }
+        strcat(ftpPath, directory);
     }
 
     return true;
 }
 
-void Sodaq_3Gbee::resetFtpDirectoryIfNeeded()
+/**
+ * Change the FTP directory to the given path, relative to the directory after login
+ *
+ * Only the directories that differ from the current path are changed: first
+ * up to the part that both paths have in common, then down into the rest of
+ * the given path. Nothing is done if the path is the current one.
+ */
+bool Sodaq_3Gbee::setFtpPath(const char* path)
 {
-    uint8_t maxTries = 2 * ftpDirectoryChangeCounter;
-    while (ftpDirectoryChangeCounter > 0 && maxTries > 0) {
-        changeFtpDirectory("..");
-        maxTries--;
+    // The path without empty and "." components, e.g. "/a//./b/" is "a/b"
+    char target[sizeof(ftpPath)];
+    size_t len = 0;
+    while (path && *path) {
+        size_t componentLen = strcspn(path, "/");
+        if (componentLen > 0 && !(componentLen == 1 && path[0] == '.')) {
+            if (len + (len > 0 ? 1 : 0) + componentLen >= sizeof(target)) {
+                debugPrintLn(DEBUG_STR_ERROR "The FTP path is too long!");
+                return false;
+            }
+            if (len > 0) {
+                target[len++] = '/';
+            }
+            memcpy(&target[len], path, componentLen);
+            len += componentLen;
+        }
+        path += componentLen;
+        if (*path == '/') {
+            path++;
+        }
+    }
+    target[len] = '\0';
+
+    // The number of directories that both paths start with
+    uint8_t commonDepth = 0;
+    const char* current = ftpPath;
+    const char* rest = target;
+    while (*current && *rest) {
+        size_t currentLen = strcspn(current, "/");
+        size_t restLen = strcspn(rest, "/");
+        if (currentLen != restLen || strncmp(current, rest, currentLen) != 0) {
+            break;
+        }
+        commonDepth++;
+        current += currentLen + (current[currentLen] == '/' ? 1 : 0);
+        rest += restLen + (rest[restLen] == '/' ? 1 : 0);
+    }
+    uint8_t depth = 0;
+    for (const char* p = ftpPath; *p; p++) {
+        if (*p == '/') {
+            depth++;
+        }
+    }
+    if (ftpPath[0] != '\0') {
+        depth++;
+    }
+
+    while (depth > commonDepth) {
+        if (!changeFtpDirectory("..")) {
+            return false;
+        }
+        depth--;
+    }
+
+    char directory[sizeof(ftpPath)];
+    while (*rest) {
+        size_t restLen = strcspn(rest, "/");
+        memcpy(directory, rest, restLen);
+        directory[restLen] = '\0';
+        if (!changeFtpDirectory(directory)) {
+            return false;
+        }
+        rest += restLen + (rest[restLen] == '/' ? 1 : 0);
     }
+
+    return true;
 }
 
 void Sodaq_3Gbee::cleanupTempFiles()
 {
     deleteFile(FTP_TMP_FILENAME);
+    deleteFile(FTP_RECEIVE_FILENAME);
     deleteFile(HTTP_RECEIVE_FILENAME);
     deleteFile(HTTP_SEND_TMP_FILENAME);
+    ftpReceiveCached = false;
 }
 
 // Returns true if the modem replies to "AT" commands without timing out.
@@ -438,8 +1056,8 @@ bool Sodaq_3Gbee::doInitialCommands()
         return false;
     }
 
-    // Switch to hex. Somehow this is also needed for AT+COPS=0
-    if (!setHexMode()) {
+    // Switch to hex (or binary, if asked for). Somehow this is also needed for AT+COPS=0
+    if (!(_socketBinaryMode ? setBinaryMode() : setHexMode())) {
         return false;
     }
 
@@ -454,6 +1072,14 @@ bool Sodaq_3Gbee::doInitialCommands()
         return false;
     }
 
+    // Report the registration changes (and the cell) in +CREG and +CGREG URC's,
+    // see waitForRegistration(). Without them the status is queried.
+    resetNetworkInfo();
+    println("AT+CREG=2");
+    _registrationUrcEnabled = (readResponse() == ResponseOK);
+    println("AT+CGREG=2");
+    readResponse();
+
     return true;
 }
 
@@ -494,20 +1120,17 @@ bool Sodaq_3Gbee::enableAutoRegistration(uint32_t timeout)
     // In some situations (new SIM card) it can take a long time
     // the get the registration. Subsequent registrations should
     // go much quicker.
-    uint32_t delay_count = 500;
     while (!is_timedout(start, timeout)) {
-        sodaq_wdt_safe_delay(delay_count);
-        // Next time wait a little longer
-        delay_count += 1000;
-
         println("AT+COPS=0");
-        if (readResponse(NULL, 40000) == ResponseOK) {
-            // TODO Fix this delay
+        if (readResponse(NULL, 40000) != ResponseOK) {
             sodaq_wdt_safe_delay(1000);
-            // We should have a name by now
-            if (getOperatorName(operator_name, sizeof(operator_name))) {
-                return true;
-            }
+            continue;
+        }
+
+        // The modem keeps trying by itself, the +CREG URC tells when it is done
+        uint32_t elapsed = millis() - start;
+        if (waitForRegistration(elapsed < timeout ? timeout - elapsed : 0)) {
+            return true;
         }
     }
     return false;
@@ -564,9 +1187,70 @@ PSDAuthType_e Sodaq_3Gbee::numToPSDAuthType(int8_t i)
     return PAT_TryAll;
 }
 
+void Sodaq_3Gbee::setPSDAuthStorage(PSDAuthLoadCallbackPtr load, PSDAuthSaveCallbackPtr save, void* parameter)
+{
+    _psdAuthLoadCallback = load;
+    _psdAuthSaveCallback = save;
+    _psdAuthStorageParameter = parameter;
+}
+
+// Returns the PSD authentication type that worked for the APN, or PAT_TryAll if unknown.
+// The modem file has "<auth type>,<apn>".
+PSDAuthType_e Sodaq_3Gbee::loadPSDAuthType()
+{
+    const char* apn = _apn ? _apn : "";
+    if (_psdAuthLoadCallback) {
+        return numToPSDAuthType(_psdAuthLoadCallback(apn, _psdAuthStorageParameter));
+    }
+
+    char buffer[80];
+    uint32_t size;
+    if (!getFileSize(PSD_AUTH_FILENAME, size) || size >= sizeof(buffer)) {
+        return PAT_TryAll;
+    }
+
+    size_t len = readFile(PSD_AUTH_FILENAME, reinterpret_cast<uint8_t*>(buffer), sizeof(buffer) - 1);
+    buffer[len] = '\0';
+
+    char* separator = strchr(buffer, ',');
+    if (!separator || strcmp(separator + 1, apn) != 0) {
+        return PAT_TryAll;
+    }
+
+    return numToPSDAuthType(atoi(buffer));
+}
+
+void Sodaq_3Gbee::savePSDAuthType(PSDAuthType_e authType)
+{
+    const char* apn = _apn ? _apn : "";
+    if (_psdAuthSaveCallback) {
+        _psdAuthSaveCallback(apn, authType, _psdAuthStorageParameter);
+        return;
+    }
+
+    char buffer[80];
+    int len = snprintf(buffer, sizeof(buffer), "%d,%s", authType, apn);
+    if (len < 0 || (size_t)len >= sizeof(buffer)) {
+        return;
+    }
+
+    deleteFile(PSD_AUTH_FILENAME);
+    writeFile(PSD_AUTH_FILENAME, reinterpret_cast<const uint8_t*>(buffer), len);
+}
+
 // Turns on and initializes the modem, then connects to the network and activates the data connection.
 bool Sodaq_3Gbee::connect()
 {
+    // No need to power up, register and activate again if the session is still good
+    if (_warmConnect && isOn() && isAlive()) {
+        NetworkRegistrationStatuses status = getNetworkStatus();
+        if ((status == Home || status == Roaming) && isConnected()) {
+            debugPrintLn("[connect]: the data connection is still active");
+            preresolveHosts();
+            return true;
+        }
+    }
+
     if (!connectSimple()) {
         return false;
     }
@@ -612,16 +1296,32 @@ bool Sodaq_3Gbee::connect()
             return false;
         }
     } else {
-        // go through all authentication methods until one succeeds
-        if (tryAuthAndActivate(PAT_None)) {
-        } else if (tryAuthAndActivate(PAT_PAP)) {
-        } else if (tryAuthAndActivate(PAT_CHAP)) {
-        } else if (tryAuthAndActivate(PAT_AutoSelect)) {
+        // go through all authentication methods until one succeeds,
+        // starting with the one that worked the previous time
+        static const PSDAuthType_e authTypes[] = { PAT_None, PAT_PAP, PAT_CHAP, PAT_AutoSelect };
+        PSDAuthType_e learnedAuthType = loadPSDAuthType();
+        PSDAuthType_e authType = PAT_TryAll;
+        if (learnedAuthType != PAT_TryAll && tryAuthAndActivate(learnedAuthType)) {
+            authType = learnedAuthType;
         } else {
+            for (size_t i = 0; i < ARRAY_SIZE(authTypes); i++) {
+                if (authTypes[i] != learnedAuthType && tryAuthAndActivate(authTypes[i])) {
+                    authType = authTypes[i];
+                    break;
+                }
+            }
+        }
+
+        if (authType == PAT_TryAll) {
             return false;
         }
+        if (authType != learnedAuthType) {
+            savePSDAuthType(authType);
+        }
     }
 
+    preresolveHosts();
+
     // If we got this far we succeeded
     return true;
 }
@@ -668,7 +1368,12 @@ bool Sodaq_3Gbee::disconnect()
     // TODO also turn off the modem?
     println("AT+UPSDA=" DEFAULT_PROFILE ",4");
 
-    return (readResponse(NULL, 40000) == ResponseOK);
+    bool retval = (readResponse(NULL, 40000) == ResponseOK);
+
+    // The sockets don't survive the deactivation
+    resetSockets();
+
+    return retval;
 }
 
 ResponseTypes Sodaq_3Gbee::_cregParser(ResponseTypes& response, const char* buffer, size_t size,
@@ -678,7 +1383,8 @@ ResponseTypes Sodaq_3Gbee::_cregParser(ResponseTypes& response, const char* buff
         return ResponseError;
     }
 
-    if (sscanf(buffer, "+CREG: %*d,%d", networkStatus) == 1) {
+    if (sscanf(buffer, "+CREG: %*d,%d", networkStatus) == 1
+            || sscanf(buffer, "+CGREG: %*d,%d", networkStatus) == 1) {
         return ResponseEmpty;
     }
 
@@ -705,20 +1411,78 @@ NetworkRegistrationStatuses Sodaq_3Gbee::getNetworkStatus()
 
     int networkStatus;
     if (readResponse<int, uint8_t>(_cregParser, &networkStatus, NULL) == ResponseOK) {
-        switch (networkStatus) {
-            case 0: return NoNetworkRegistrationStatus;
-            case 1: return Home;
-            case 2: return NoNetworkRegistrationStatus;
-            case 3: return Denied;
-            case 4: return UnknownNetworkRegistrationStatus;
-            case 5: return Roaming;
-            default: return Denied; // rest of statuses are actually registered, but they do not support data
+        NetworkRegistrationStatuses status = convert_network_status(networkStatus);
+
+        // Keep the URC state in sync, in case a URC was missed
+        if (status != _networkInfo.status) {
+            _networkInfo.status = status;
+            _networkInfo.changedAt = NOW;
+        }
+
+        return status;
+    }
+
+    return UnknownNetworkRegistrationStatus;
+}
+
+// Returns the current status of the packet switched registration.
+// The meaning of <status> is the same as for getNetworkStatus().
+NetworkRegistrationStatuses Sodaq_3Gbee::getGprsNetworkStatus()
+{
+    println("AT+CGREG?");
+
+    int networkStatus;
+    if (readResponse<int, uint8_t>(_cregParser, &networkStatus, NULL) == ResponseOK) {
+        NetworkRegistrationStatuses status = convert_network_status(networkStatus);
+
+        // Keep the URC state in sync, in case a URC was missed
+        if (status != _networkInfo.gprsStatus) {
+            _networkInfo.gprsStatus = status;
+            _networkInfo.changedAt = NOW;
         }
+
+        return status;
     }
 
     return UnknownNetworkRegistrationStatus;
 }
 
+bool Sodaq_3Gbee::waitForRegistration(uint32_t timeout)
+{
+    uint32_t start = millis();
+    uint32_t lastQuery = start;
+    getNetworkStatus();
+    getGprsNetworkStatus();
+
+    // A packet switched only registration is good enough for the data connection
+    while (!is_registered(_networkInfo.status) && !is_registered(_networkInfo.gprsStatus)) {
+        if (is_timedout(start, timeout)) {
+            return false;
+        }
+
+        // The URC's, if they are enabled, update _networkInfo
+        pollIdle();
+        if (!_registrationUrcEnabled && is_timedout(lastQuery, NETWORK_STATUS_QUERY_INTERVAL)) {
+            lastQuery = millis();
+            getNetworkStatus();
+            getGprsNetworkStatus();
+        }
+        sodaq_wdt_reset();
+    }
+
+    return true;
+}
+
+void Sodaq_3Gbee::resetNetworkInfo()
+{
+    _networkInfo.status = UnknownNetworkRegistrationStatus;
+    _networkInfo.gprsStatus = UnknownNetworkRegistrationStatus;
+    _networkInfo.technology = UnknownNetworkTechnology;
+    _networkInfo.lac = 0;
+    _networkInfo.cellId = 0;
+    _networkInfo.changedAt = NOW;
+}
+
 // Returns the network technology the modem is currently registered to.
 NetworkTechnologies Sodaq_3Gbee::getNetworkTechnology()
 {
@@ -726,16 +1490,7 @@ NetworkTechnologies Sodaq_3Gbee::getNetworkTechnology()
 
     int networkTechnology;
     if (readResponse<int, uint8_t>(_copsParser, &networkTechnology, NULL) == ResponseOK) {
-        switch (networkTechnology) {
-            case 0: return GSM;
-            case 1: return GSM;
-            case 2: return UTRAN;
-            case 3: return EDGE;
-            case 4: return HSDPA;
-            case 5: return HSUPA;
-            case 6: return HSDPAHSUPA;
-            case 7: return LTE;
-        }
+        return convert_network_technology(networkTechnology);
     }
 
     return UnknownNetworkTechnology;
@@ -851,107 +1606,204 @@ bool Sodaq_3Gbee::getOperatorName(char* buffer, size_t size)
     return (buffer[0] != '\0');
 }
 
-bool Sodaq_3Gbee::selectBestOperator(Stream & verbose_stream)
+bool Sodaq_3Gbee::selectBestOperator(Stream & verbose_stream, uint32_t maxSurveyAge)
 {
-    String listOfOperators;
     String oper_long;
     String oper_num;
-    size_t oper_status;
-    uint8_t highest_csq = 0;
-    size_t highest_csq_ix = 0;
+
+    if (maxSurveyAge == 0 || _operatorSurveyCount == 0 || !_operatorSurvey[0].registered
+            || is_timedout(_operatorSurvey[0].surveyedAt, maxSurveyAge)) {
+        String listOfOperators;
+        _operatorSurveyCount = 0;
+        if (!getOperatorList(listOfOperators, verbose_stream)) {
+            return false;
+        }
+
+        // There is nothing to rank with only one available operator
+        String name;
+        String number;
+        size_t status;
+        size_t nr_valid_opers = 0;
+        for (size_t ix = 0; getNthOperator(listOfOperators, ix, name, number, status); ++ix) {
+            if (status == 1 || status == 2) {      // 1: available, 2: current, 3: forbidden
+                nr_valid_opers++;
+                oper_long = name;
+                oper_num = number;
+            }
+        }
+
+        if (nr_valid_opers == 0) {
+            verbose_stream.println("ERROR: No available operators");
+            return false;
+        }
+        if (nr_valid_opers > 1) {
+            if (surveyOperatorList(listOfOperators, verbose_stream, DEFAULT_OPERATOR_SURVEY_SAMPLES) == 0) {
+                verbose_stream.println("ERROR: Unable to register to any operator");
+                return false;
+            }
+            oper_long = _operatorSurvey[0].longName;
+            oper_num = _operatorSurvey[0].number;
+        }
+    } else {
+        oper_long = _operatorSurvey[0].longName;
+        oper_num = _operatorSurvey[0].number;
+    }
+
+    // Only the best operator is connected to
+    verbose_stream.println();
+    verbose_stream.println("=======================");
+    verbose_stream.println(String("Selecting best operator: \"") + oper_long + '"');
+    verbose_stream.println(String("                 number: ") + oper_num);
+
     int8_t lastRSSI;
-    uint8_t lastCSQ;
+    if (!selectOperatorWithRSSI(oper_long, oper_num, lastRSSI, verbose_stream)) {
+        // Error message already given
+        return false;
+    }
+    verbose_stream.println(String("  RSSI: ") + lastRSSI + "dBm (CSQ: " + convertRSSI2CSQ(lastRSSI) + ")");
 
-    // Get list of operators
+    // No need to disconnect. We're switching off in a moment.
+
+    return true;
+}
+
+// Returns true if operator a ranks above operator b.
+static bool is_better_operator(const OperatorSurveyEntry_t& a, const OperatorSurveyEntry_t& b)
+{
+    if (a.registered != b.registered) {
+        return a.registered;
+    }
+
+    // An unknown RSSI (0) ranks last
+    int rssiA = (a.rssi == 0) ? -128 : a.rssi;
+    int rssiB = (b.rssi == 0) ? -128 : b.rssi;
+
+    return rssiA > rssiB;
+}
+
+uint8_t Sodaq_3Gbee::surveyOperators(Stream & verbose_stream, uint8_t samples)
+{
+    String listOfOperators;
+
+    _operatorSurveyCount = 0;
+    if (!getOperatorList(listOfOperators, verbose_stream)) {
+        return 0;
+    }
+
+    return surveyOperatorList(listOfOperators, verbose_stream, samples);
+}
+
+bool Sodaq_3Gbee::getOperatorList(String& listOfOperators, Stream& verbose_stream)
+{
     uint32_t delay_count = 500;
-    bool found_list = false;
     for (size_t ix = 0; ix < 5; ++ix) {
         if (getOperators(listOfOperators)) {
-            found_list = true;
-            break;
+            return true;
         }
         sodaq_wdt_safe_delay(delay_count);
         delay_count += 500;
     }
-    if (!found_list) {
-        verbose_stream.println("ERROR: Unable to get a list of operators");
-        return false;
-    }
 
-    // Select each and keep track of highest CSQ.
+    verbose_stream.println("ERROR: Unable to get a list of operators");
+    return false;
+}
+
+uint8_t Sodaq_3Gbee::surveyOperatorList(const String& listOfOperators, Stream& verbose_stream, uint8_t samples)
+{
+    String oper_long;
+    String oper_num;
+    size_t oper_status;
+
+    _operatorSurveyCount = 0;
 
+    // Register to each and sample the signal quality, the data connection is not needed for that
     verbose_stream.println(String("List of available operators: ") + listOfOperators);
-    size_t nr_valid_opers = 0;
-    for (size_t ix = 0; ; ++ix) {
-        if (getNthOperator(listOfOperators, ix, oper_long, oper_num, oper_status)) {
-            verbose_stream.println("=======================");
-            verbose_stream.println(String("  operator: ") + oper_long);
-            verbose_stream.println(String("    number: ") + oper_num);
-            //debugPrintLn(String("  status: ") + oper_status);
-            if (oper_status == 1 || oper_status == 2) {      // 1: available, 2: current, 3: forbidden
-                nr_valid_opers++;
-                highest_csq_ix = ix;
-            }
+    uint8_t registeredCount = 0;
+    for (size_t ix = 0; getNthOperator(listOfOperators, ix, oper_long, oper_num, oper_status); ++ix) {
+        if (!(oper_status == 1 || oper_status == 2)) {      // 1: available, 2: current, 3: forbidden
+            continue;
+        }
+
+        verbose_stream.println();
+        verbose_stream.println("=======================");
+        verbose_stream.println(String("  operator: ") + oper_long);
+        verbose_stream.println(String("    number: ") + oper_num);
+
+        OperatorSurveyEntry_t entry;
+        strncpy(entry.longName, oper_long.c_str(), sizeof(entry.longName) - 1);
+        entry.longName[sizeof(entry.longName) - 1] = '\0';
+        strncpy(entry.number, oper_num.c_str(), sizeof(entry.number) - 1);
+        entry.number[sizeof(entry.number) - 1] = '\0';
+        entry.rssi = 0;
+        entry.technology = UnknownNetworkTechnology;
+        entry.registered = (oper_num != "" && selectOperatorNum(oper_num, 60000))
+                || (oper_long != "" && selectOperator(oper_long, 60000));
+
+        if (entry.registered) {
+            sampleOperator(entry, samples);
+            registeredCount++;
+            verbose_stream.println(String("  RSSI: ") + entry.rssi + "dBm (CSQ: " + convertRSSI2CSQ(entry.rssi) + ")");
         } else {
-            // No more operators in the list
-            break;
+            verbose_stream.println("ERROR: Failed to select operator");
         }
-    }
-    verbose_stream.println("=======================");
-    verbose_stream.println(String("Number of available operators: ") + nr_valid_opers);
-    if (nr_valid_opers == 0) {
-        return false;
-    }
-
-    // Only do a check of all available if we have at least 2 or more
-    if (nr_valid_opers > 1) {
-        for (size_t ix = 0; ; ++ix) {
-            if (getNthOperator(listOfOperators, ix, oper_long, oper_num, oper_status)) {
-                verbose_stream.println();
-                verbose_stream.println("=======================");
-                verbose_stream.println(String("  operator: ") + oper_long);
-                verbose_stream.println(String("    number: ") + oper_num);
-                //debugPrintLn(String("  status: ") + oper_status);
-                if (oper_status == 1 || oper_status == 2) {      // 1: available, 2: current, 3: forbidden
-                    if (selectOperatorWithRSSI(oper_long, oper_num, lastRSSI, verbose_stream)) {
-                        lastCSQ = convertRSSI2CSQ(lastRSSI);
-                        verbose_stream.println(String("  RSSI: ") + lastRSSI + "dBm (CSQ: " + lastCSQ + ")");
-                        if (lastCSQ > highest_csq) {
-                            highest_csq = lastCSQ;
-                            highest_csq_ix = ix;
-                        }
-                    }
-                }
-            } else {
-                // No more operators in the list
-                break;
+        entry.surveyedAt = NOW;
+
+        // When the ranking is full, the worst operator is dropped
+        uint8_t rank = _operatorSurveyCount;
+        if (rank == OPERATOR_SURVEY_SIZE) {
+            if (!is_better_operator(entry, _operatorSurvey[rank - 1])) {
+                verbose_stream.println("  not kept, the ranking is full");
+                continue;
             }
+            verbose_stream.println(String("  replaces: ") + _operatorSurvey[rank - 1].longName);
+            rank--;
+        } else {
+            _operatorSurveyCount++;
         }
-    }
 
-    // Select the operator with highest CSQ, or the only available operator
-    verbose_stream.println();
-    if (!getNthOperator(listOfOperators, highest_csq_ix, oper_long, oper_num, oper_status)) {
-        // Shouldn't happen
-        return false;
+        // Keep the entries in rank order
+        while (rank > 0 && is_better_operator(entry, _operatorSurvey[rank - 1])) {
+            _operatorSurvey[rank] = _operatorSurvey[rank - 1];
+            rank--;
+        }
+        _operatorSurvey[rank] = entry;
     }
+
     verbose_stream.println("=======================");
-    verbose_stream.println(String("Selecting best operator: \"") + oper_long + '"');
-    verbose_stream.println(String("                 number: ") + oper_num);
+    verbose_stream.println(String("Number of registered operators: ") + registeredCount);
 
-    if (!(oper_status == 1 || oper_status == 2)) {      // 1: available, 2: current, 3: forbidden
-        // Shouldn't happen
-        return false;
-    }
+    return registeredCount;
+}
 
-    if (!selectOperatorWithRSSI(oper_long, oper_num, lastRSSI, verbose_stream)) {
-        // Shouldn't happen, error message already given
-        return false;
+const OperatorSurveyEntry_t* Sodaq_3Gbee::getOperatorSurveyEntry(uint8_t rank) const
+{
+    if (rank >= _operatorSurveyCount) {
+        return NULL;
     }
 
-    // No need to disconnect. We're switching off in a moment.
+    return &_operatorSurvey[rank];
+}
 
-    return true;
+void Sodaq_3Gbee::sampleOperator(OperatorSurveyEntry_t& entry, uint8_t samples)
+{
+    int total = 0;
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < samples; i++) {
+        if (i > 0) {
+            sodaq_wdt_safe_delay(OPERATOR_SURVEY_SAMPLE_INTERVAL);
+        }
+
+        int8_t rssi;
+        uint8_t ber;
+        if (getRSSIAndBER(&rssi, &ber) && rssi != 0) {
+            total += rssi;
+            count++;
+        }
+    }
+    entry.rssi = (count > 0) ? (total / count) : 0;
+
+    // The +CREG URC of the previous operator may still be the latest, so ask
+    entry.technology = getNetworkTechnology();
 }
 
 bool Sodaq_3Gbee::selectOperatorWithRSSI(const String & oper_long, const String & oper_num,
@@ -1117,16 +1969,7 @@ bool Sodaq_3Gbee::selectOperator(const String & oper_long, uint32_t timeout)
     println(String("AT+COPS=1,0,\"") + oper_long + '"');
     if (readResponse(NULL, 60000) == ResponseOK) {
         // Now wait for URC +CREG
-        // ???? How do we do that?
-        uint32_t start = millis();
-        while (!is_timedout(start, timeout)) {
-            NetworkRegistrationStatuses status;
-            status = getNetworkStatus();
-            if (status == Home || status == Roaming) {
-                retval = true;
-                break;
-            }
-        }
+        retval = waitForRegistration(timeout);
     }
 
     return retval;
@@ -1142,16 +1985,7 @@ bool Sodaq_3Gbee::selectOperatorNum(const String & oper_num, uint32_t timeout)
     println(String("AT+COPS=1,2,\"") + oper_num + '"');
     if (readResponse(NULL, 60000) == ResponseOK) {
         // Now wait for URC +CREG
-        // ???? How do we do that?
-        uint32_t start = millis();
-        while (!is_timedout(start, timeout)) {
-            NetworkRegistrationStatuses status;
-            status = getNetworkStatus();
-            if (status == Home || status == Roaming) {
-                retval = true;
-                break;
-            }
-        }
+        retval = waitForRegistration(timeout);
     }
 
     return retval;
@@ -1159,14 +1993,12 @@ bool Sodaq_3Gbee::selectOperatorNum(const String & oper_num, uint32_t timeout)
 
 bool Sodaq_3Gbee::waitForDeactivatedNetwork(uint32_t timeout)
 {
-    // This loop relies on readResponse being called via isAlive()
+    // This loop relies on the URC's being handled by poll()
     uint32_t start = millis();
-    uint32_t delay_count = 50;
     _foundUUPSDD = false;
     while (!_foundUUPSDD && !is_timedout(start, timeout)) {
-        isAlive();
-        sodaq_wdt_safe_delay(delay_count);
-        delay_count += 250;
+        pollIdle();
+        sodaq_wdt_reset();
     }
 
     return _foundUUPSDD;
@@ -1452,8 +2284,10 @@ ResponseTypes Sodaq_3Gbee::_usocrParser(ResponseTypes& response, const char* buf
 // Returns the IP of the given host (nslookup).
 IP_t Sodaq_3Gbee::getHostIP(const char* host)
 {
-    if (_host_ip != NO_IP_ADDRESS && strcmp(host, _host_name) == 0) {
-        return _host_ip;
+    DnsCacheEntry_t* entry = findDnsCacheEntry(host);
+    if (entry) {
+        entry->lastUsed = ++_dnsCacheUseCount;
+        return entry->ip;
     }
 
     IP_t ip = NO_IP_ADDRESS;
@@ -1461,22 +2295,99 @@ IP_t Sodaq_3Gbee::getHostIP(const char* host)
     print("AT+UDNSRN=0,\"");
     print(host);
     println("\"");
-    if (readResponse<IP_t, uint8_t>(_udnsrnParser, &ip, NULL, NULL, 70000) == ResponseOK) {
-        if (ip != NO_IP_ADDRESS) {
-            // Try to cache it
-            // Only if it fits
-            if (strlen(host) < sizeof(_host_name) - 1) {
-                memset(_host_name, 0, sizeof(_host_name));
-                strncpy(_host_name, host, sizeof(_host_name) - 1);
-                _host_ip = ip;
-            }
-        }
+    ResponseTypes response = readResponse<IP_t, uint8_t>(_udnsrnParser, &ip, NULL, NULL, 70000);
+    if (response == ResponseOK && ip != NO_IP_ADDRESS) {
+        storeDnsCacheEntry(host, ip);
         return ip;
     }
 
+    // The host does not resolve, but a timeout can have any cause and is not cached
+    if (response == ResponseOK || response == ResponseError) {
+        storeDnsCacheEntry(host, NO_IP_ADDRESS);
+    }
+
     return NO_IP_ADDRESS;
 }
 
+void Sodaq_3Gbee::setDnsCacheTtl(uint32_t ttl, uint32_t failureTtl)
+{
+    _dnsCacheTtl = ttl;
+    _dnsCacheFailureTtl = failureTtl;
+}
+
+void Sodaq_3Gbee::setPreresolveHosts(const char* const* hosts, uint8_t count)
+{
+    _preresolveHosts = hosts;
+    _preresolveHostCount = count;
+}
+
+void Sodaq_3Gbee::clearCachedHostIp()
+{
+    for (size_t i = 0; i < ARRAY_SIZE(_dnsCache); i++) {
+        _dnsCache[i].host[0] = '\0';
+    }
+}
+
+DnsCacheEntry_t* Sodaq_3Gbee::findDnsCacheEntry(const char* host)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(_dnsCache); i++) {
+        DnsCacheEntry_t& entry = _dnsCache[i];
+        if (entry.host[0] != '\0' && strcmp(entry.host, host) == 0) {
+            uint32_t ttl = (entry.ip != NO_IP_ADDRESS) ? _dnsCacheTtl : _dnsCacheFailureTtl;
+            if (is_timedout(entry.resolvedAt, ttl)) {
+                entry.host[0] = '\0';
+                return NULL;
+            }
+
+            return &entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Stores the given host in a free entry of the DNS cache, or else in the least recently used one.
+void Sodaq_3Gbee::storeDnsCacheEntry(const char* host, IP_t ip)
+{
+    if (strlen(host) > DNS_CACHE_HOST_SIZE || (ip == NO_IP_ADDRESS && _dnsCacheFailureTtl == 0)) {
+        return;
+    }
+
+    DnsCacheEntry_t* entry = &_dnsCache[0];
+    for (size_t i = 0; i < ARRAY_SIZE(_dnsCache); i++) {
+        if (_dnsCache[i].host[0] == '\0') {
+            entry = &_dnsCache[i];
+            break;
+        }
+        if (_dnsCache[i].lastUsed < entry->lastUsed) {
+            entry = &_dnsCache[i];
+        }
+    }
+
+    strcpy(entry->host, host);
+    entry->ip = ip;
+    entry->resolvedAt = millis();
+    entry->lastUsed = ++_dnsCacheUseCount;
+}
+
+// Resolves the hosts of setPreresolveHosts(), which are then cached.
+void Sodaq_3Gbee::preresolveHosts()
+{
+    // The failures may have been caused by not being connected
+    for (size_t i = 0; i < ARRAY_SIZE(_dnsCache); i++) {
+        if (_dnsCache[i].ip == NO_IP_ADDRESS) {
+            _dnsCache[i].host[0] = '\0';
+        }
+    }
+
+    for (uint8_t i = 0; i < _preresolveHostCount; i++) {
+        if (_preresolveHosts[i] && !isValidIPv4(_preresolveHosts[i])) {
+            getHostIP(_preresolveHosts[i]);
+        }
+        sodaq_wdt_reset();
+    }
+}
+
 bool Sodaq_3Gbee::getSessionCounters(uint32_t* sentCnt, uint32_t* recvCnt)
 {
     println("AT+UGCNTRD");
@@ -1538,6 +2449,12 @@ int Sodaq_3Gbee::createSocket(Protocols protocol, uint16_t localPort)
 
     uint8_t socket;
     if (readResponse<uint8_t, uint8_t>(_usocrParser, &socket, NULL) == ResponseOK) {
+        if (socket < ARRAY_SIZE(_sockets)) {
+            SocketInfo_t& info = _sockets[socket];
+            memset(&info, 0, sizeof(info));
+            info.state = SocketCreated;
+            info.protocol = protocol;
+        }
         return socket;
     }
 
@@ -1608,32 +2525,49 @@ bool Sodaq_3Gbee::isValidIPv4(const char* str)
     return true;
 }
 
+// Returns the IP of the given host, which can also be given in dotted notation.
+IP_t Sodaq_3Gbee::resolveHost(const char* host)
+{
+    if (isValidIPv4(host)) {
+        int o1, o2, o3, o4;
+        sscanf(host, IP_FORMAT, &o1, &o2, &o3, &o4);
+        return TUPLE_TO_IP(o1, o2, o3, o4);
+    }
+
+    return getHostIP(host);
+}
+
 // Requests a connection to the given host and port, on the given socket.
 // Returns true if successful.
 bool Sodaq_3Gbee::connectSocket(uint8_t socket, const char* host, uint16_t port)
 {
-    bool usePassedHost;
-    char ipBuffer[16];
-
-    if (isValidIPv4(host)) {
-        usePassedHost = true;
+    if (socket >= ARRAY_SIZE(_sockets)) {
+        return false;
     }
-    else {
-        usePassedHost = false;
-        if (ipToString(getHostIP(host), ipBuffer, sizeof(ipBuffer)) <= 0) {
-            return false;
-        }
+
+    IP_t ip = resolveHost(host);
+    if (ip == NO_IP_ADDRESS) {
+        return false;
     }
 
-    _socketClosedBit[socket] = false;
+    char ipBuffer[16];
+    ipToString(ip, ipBuffer, sizeof(ipBuffer));
+
+    SocketInfo_t& info = _sockets[socket];
+    info.closed = false;
+    info.remoteIP = ip;
+    info.remotePort = port;
     print("AT+USOCO=");
     print(socket);
     print(",\"");
-    print(usePassedHost ? host : ipBuffer);
+    print(ipBuffer);
     print("\",");
     println(port);
 
     bool retval = (readResponse(NULL, 30000) == ResponseOK);
+    if (retval) {
+        info.state = SocketConnected;
+    }
     _timeToSocketConnect = millis() - _startOn;
     return retval;
 }
@@ -1642,28 +2576,120 @@ bool Sodaq_3Gbee::connectSocket(uint8_t socket, const char* host, uint16_t port)
 // Returns true if successful.
 bool Sodaq_3Gbee::socketSend(uint8_t socket, const uint8_t* buffer, size_t size)
 {
-    // TODO see if we should keep an array of sockets so that the UDP-specific
-    // commands can be used instead, without first initializing the UDP socket
-    // OR maybe query the socket type? AT+USOCTL=0,0  => +USOCTL:0,0,6 (socket #0 is TCP)
+    // NOTE: for UDP sockets that are not connected, use sendTo()
 
     // TODO +USOCTL=1 check last error, (11: queue full)
 
+    // Anything buffered by socketWrite() goes first
+    if (!socketFlush(socket)) {
+        return false;
+    }
+
+    // Larger buffers are sent in segments of the maximum the modem accepts
+    bool status = true;
+    while (status && size > 0) {
+        size_t segment = (size > MAX_SOCKET_WRITE) ? MAX_SOCKET_WRITE : size;
+        status = socketSendSegment(socket, buffer, segment);
+        buffer += segment;
+        size -= segment;
+    }
+
+    if (_flushEverySend && status) {
+        // We want to be sure it is sent
+        status = waitForSocketOutput(socket);
+    }
+    return status;
+}
+
+// Sends a single AT+USOWR, the size must not exceed MAX_SOCKET_WRITE
+bool Sodaq_3Gbee::socketSendSegment(uint8_t socket, const uint8_t* buffer, size_t size)
+{
     print("AT+USOWR=");
     print(socket);
     print(",");
     println(size);
 
     // Wait for prompt. See writeFile
-    if (readResponse() == ResponsePrompt) {
-        // After the @ prompt reception, wait for a minimum of 50 ms before sending data.
-        delay(51);
+    if (readResponse() != ResponsePrompt) {
+        return false;
+    }
 
-        for (size_t i = 0; i < size; ++i) {
-            writeByte(buffer[i]);
-        }
+    // After the @ prompt reception, wait for a minimum of 50 ms before sending data.
+    delay(51);
+
+    for (size_t i = 0; i < size; ++i) {
+        writeByte(buffer[i]);
     }
 
     bool status = (readResponse(NULL, 10000) == ResponseOK);
+    if (status && socket < ARRAY_SIZE(_sockets)) {
+        _sockets[socket].bytesSent += size;
+    }
+    return status;
+}
+
+// Buffers the given data for the given socket, see socketFlush().
+// Returns true if successful.
+bool Sodaq_3Gbee::socketWrite(uint8_t socket, const uint8_t* buffer, size_t size)
+{
+    // The buffer holds the data of one socket at a time
+    if (_writeBufferCount > 0 && _writeBufferSocket != socket) {
+        if (!socketFlush(_writeBufferSocket)) {
+            return false;
+        }
+    }
+
+    if (!_writeBuffer) {
+        _writeBuffer = static_cast<uint8_t*>(malloc(_writeBufferSize));
+        if (!_writeBuffer) {
+            return socketSend(socket, buffer, size);
+        }
+    }
+
+    if (_writeBufferCount + size > _writeBufferSize) {
+        if (!socketFlush(socket)) {
+            return false;
+        }
+
+        // Too big to buffer, send it right away
+        if (size > _writeBufferSize) {
+            return socketSend(socket, buffer, size);
+        }
+    }
+
+    memcpy(&_writeBuffer[_writeBufferCount], buffer, size);
+    _writeBufferCount += size;
+    _writeBufferSocket = socket;
+
+    return true;
+}
+
+// Sends the data buffered by socketWrite() for the given socket.
+// Returns true if successful.
+bool Sodaq_3Gbee::socketFlush(uint8_t socket)
+{
+    if (_writeBufferCount == 0 || _writeBufferSocket != socket) {
+        return true;
+    }
+
+    // The data is kept until the modem has accepted it, only the segments sent are dropped
+    size_t sent = 0;
+    bool status = true;
+    while (status && sent < _writeBufferCount) {
+        size_t segment = _writeBufferCount - sent;
+        if (segment > MAX_SOCKET_WRITE) {
+            segment = MAX_SOCKET_WRITE;
+        }
+        status = socketSendSegment(socket, &_writeBuffer[sent], segment);
+        if (status) {
+            sent += segment;
+        }
+    }
+    if (sent > 0) {
+        memmove(_writeBuffer, &_writeBuffer[sent], _writeBufferCount - sent);
+        _writeBufferCount -= sent;
+    }
+
     if (_flushEverySend && status) {
         // We want to be sure it is sent
         status = waitForSocketOutput(socket);
@@ -1671,6 +2697,29 @@ bool Sodaq_3Gbee::socketSend(uint8_t socket, const uint8_t* buffer, size_t size)
     return status;
 }
 
+// Drops the data buffered by socketWrite() for the given socket.
+void Sodaq_3Gbee::discardSocketWrites(uint8_t socket)
+{
+    if (_writeBufferSocket == socket) {
+        _writeBufferCount = 0;
+    }
+}
+
+// Sets the size of the buffer used by socketWrite(). Buffered data is sent first.
+// Returns false if it could not be sent, the buffer is not changed then.
+bool Sodaq_3Gbee::setSocketWriteBufferSize(size_t size)
+{
+    if (_writeBufferCount > 0 && !socketFlush(_writeBufferSocket)) {
+        return false;
+    }
+
+    free(_writeBuffer);
+    _writeBuffer = NULL;
+    _writeBufferSize = size;
+
+    return true;
+}
+
 // Sends the given buffer through the given socket.
 // Returns true if successful.
 bool Sodaq_3Gbee::socketSend(uint8_t socket, const char* str)
@@ -1678,89 +2727,172 @@ bool Sodaq_3Gbee::socketSend(uint8_t socket, const char* str)
     return socketSend(socket, (uint8_t *)str, strlen(str));
 }
 
-ResponseTypes Sodaq_3Gbee::_usordParser(ResponseTypes& response, const char* buffer, size_t size,
-        char* resultBuffer, uint8_t* dummy)
+// Reads data from the given socket into the given buffer.
+// Returns the number of bytes written to the buffer.
+// NOTE: if the modem hasn't reported available data, it blocks for up to 10 seconds waiting.
+size_t Sodaq_3Gbee::socketReceive(uint8_t socket, uint8_t* buffer, size_t size, uint32_t timeout)
 {
-    if (!resultBuffer) {
-        return ResponseError;
+    if (socket >= ARRAY_SIZE(_sockets)) {
+        return 0;
     }
 
-    int socket, count;
-    if ((sscanf(buffer, "+USORD: %d,%d,", &socket, &count) == 2)
-        && (buffer[size - count*2 - 2] == '\"')
-        && (buffer[size - 1] == '\"')
-        && (count < MAX_SOCKET_BUFFER)) {
-        memcpy(resultBuffer, &buffer[size - 1 - count*2], count*2);
-        resultBuffer[count*2] = 0;
+    SocketInfo_t& info = _sockets[socket];
+    size_t count = waitForSocketData(socket, size, timeout);
+    if (count == 0) {
+        return 0;
+    }
 
-        return ResponseEmpty;
+    print("AT+USORD=");
+    print(socket);
+    print(",");
+    println(count);
+
+    int received = readSocketData("+USORD:", buffer, count);
+    if (received < 0) {
+        return 0;
     }
 
-    return ResponseError;
+    info.pendingBytes -= received;
+    info.bytesReceived += received;
+    return received;
 }
 
-// Reads data from the given socket into the given buffer.
+// Blocks for up to "timeout" ms while there are no data available on the given socket.
+// Returns the number of bytes that can be read in one go into a buffer of the given size.
+size_t Sodaq_3Gbee::waitForSocketData(uint8_t socket, size_t size, uint32_t timeout)
+{
+    // A reply can only be expected after the buffered data is sent
+    socketFlush(socket);
+
+    SocketInfo_t& info = _sockets[socket];
+    uint32_t start = millis();
+    while (info.pendingBytes == 0 && !is_timedout(start, timeout)) {
+        pollIdle();
+        sodaq_wdt_reset();
+    }
+
+    size_t count = (info.pendingBytes > size) ? size : info.pendingBytes;
+
+    // bound the count to what the modem allows in a single AT+USORD/AT+USORF
+    size_t maxCount = _socketBinaryMode ? MAX_SOCKET_READ_BINARY : MAX_SOCKET_READ_HEX;
+    if (count > maxCount) {
+        count = maxCount;
+    }
+
+    return count;
+}
+
+// Sends the given buffer as a datagram to the given remote, through the given UDP socket.
+// Returns true if successful.
+bool Sodaq_3Gbee::sendTo(uint8_t socket, IP_t ip, uint16_t port, const uint8_t* buffer, size_t size)
+{
+    char ipBuffer[16];
+    ipToString(ip, ipBuffer, sizeof(ipBuffer));
+
+    print("AT+USOST=");
+    print(socket);
+    print(",\"");
+    print(ipBuffer);
+    print("\",");
+    print(port);
+    print(",");
+    println(size);
+
+    // Wait for prompt. See socketSend
+    if (readResponse() == ResponsePrompt) {
+        // After the @ prompt reception, wait for a minimum of 50 ms before sending data.
+        delay(51);
+
+        for (size_t i = 0; i < size; ++i) {
+            writeByte(buffer[i]);
+        }
+    }
+
+    // +USOST: <socket>,<length>
+    bool status = (readResponse(NULL, 10000) == ResponseOK);
+    if (status && socket < ARRAY_SIZE(_sockets)) {
+        _sockets[socket].bytesSent += size;
+    }
+
+    return status;
+}
+
+// Sends the given buffer as a datagram to the given host and port, through the given UDP socket.
+// Returns true if successful.
+bool Sodaq_3Gbee::sendTo(uint8_t socket, const char* host, uint16_t port, const uint8_t* buffer, size_t size)
+{
+    IP_t ip = resolveHost(host);
+    if (ip == NO_IP_ADDRESS) {
+        return false;
+    }
+
+    return sendTo(socket, ip, port, buffer, size);
+}
+
+// Reads a datagram from the given UDP socket into the given buffer. The sender is
+// returned in "remoteIP" and "remotePort" (both are optional).
 // Returns the number of bytes written to the buffer.
 // NOTE: if the modem hasn't reported available data, it blocks for up to 10 seconds waiting.
-size_t Sodaq_3Gbee::socketReceive(uint8_t socket, uint8_t* buffer, size_t size)
+size_t Sodaq_3Gbee::receiveFrom(uint8_t socket, uint8_t* buffer, size_t size, IP_t* remoteIP, uint16_t* remotePort)
 {
-    if (socket >= ARRAY_SIZE(_socketPendingBytes)) {
+    if (socket >= ARRAY_SIZE(_sockets)) {
         return 0;
     }
 
-    // if there are no data available yet, block for some seconds while checking
-    uint32_t start = millis();
-    uint32_t delay_count = 50;
-    while (_socketPendingBytes[socket] == 0 && !is_timedout(start, 10000)) {
-        isAlive();
-        sodaq_wdt_safe_delay(delay_count);
-        if (delay_count < 2000) {
-            delay_count += 250;
-        }
+    SocketInfo_t& info = _sockets[socket];
+    size_t count = waitForSocketData(socket, size);
+    if (count == 0) {
+        return 0;
+    }
+
+    print("AT+USORF=");
+    print(socket);
+    print(",");
+    println(count);
+
+    // +USORF: 0,"151.9.34.66",449,16,"<data>"
+    char* field;
+    size_t len;
+    if (!readDataPrefix("+USORF:", field, len) || !readUntilView('"', field, len)) {
+        return 0;
+    }
+
+    int o1, o2, o3, o4;
+    if (sscanf(field, IP_FORMAT, &o1, &o2, &o3, &o4) != 4) {
+        return 0;
     }
+    IP_t ip = TUPLE_TO_IP(o1, o2, o3, o4);
 
-    size_t pending = _socketPendingBytes[socket];
-    size_t count = (pending > size) ? size : pending;
+    int values[2];
+    if (!readUntilView('"', field, len) || field[0] != ','
+            || parse_int_list(&field[1], values, 2) != 2) {
+        return 0;
+    }
 
-    if (pending == 0) {
+    int received = readSocketPayload(buffer, size, values[1]);
+    if (received < 0) {
         return 0;
     }
 
-    // bound the count, as the socket bytes are in hex string (so 2 * bytes)
-    if (count > MAX_SOCKET_BUFFER/2) {
-        count = MAX_SOCKET_BUFFER/2;
+    if (remoteIP) {
+        *remoteIP = ip;
     }
-
-    print("AT+USORD=");
-    print(socket);
-    print(",");
-    println(count);
-
-    char resultBuffer[MAX_SOCKET_BUFFER];
-    if (readResponse<char, uint8_t>(_usordParser, resultBuffer, NULL) == ResponseOK) {
-        // stop at the first string termination char, or if output buffer is over, or if payload buffer is over
-        size_t outputIndex = 0;
-        size_t inputIndex = 0;
-
-        while (outputIndex < count
-            && resultBuffer[inputIndex] != 0
-            && resultBuffer[inputIndex + 1] != 0) {
-            buffer[outputIndex] = HEX_PAIR_TO_BYTE(resultBuffer[inputIndex], resultBuffer[inputIndex + 1]);
-
-            inputIndex += 2;
-            outputIndex++;
-        }
-
-        _socketPendingBytes[socket] -= count;
-        return count;
+    if (remotePort) {
+        *remotePort = values[0];
     }
 
-    return 0;
+    info.pendingBytes -= received;
+    info.bytesReceived += received;
+    return received;
 }
 
 size_t Sodaq_3Gbee::socketBytesPending(uint8_t socket)
 {
-    return _socketPendingBytes[socket];
+    if (socket >= ARRAY_SIZE(_sockets)) {
+        return 0;
+    }
+
+    return _sockets[socket].pendingBytes;
 }
 
 // Closes the given socket.
@@ -1768,16 +2900,88 @@ size_t Sodaq_3Gbee::socketBytesPending(uint8_t socket)
 bool Sodaq_3Gbee::closeSocket(uint8_t socket)
 {
     // Wait until there are no more unacknowledged output data
+    socketFlush(socket);
     waitForSocketOutput(socket);
 
     print("AT+USOCL=");
     println(socket);
 
     bool retval = (readResponse(NULL, 20000) == ResponseOK);
+    if (retval && socket < ARRAY_SIZE(_sockets)) {
+        _sockets[socket].state = SocketFree;
+    }
+    discardSocketWrites(socket);
     _timeToSocketClose = millis() - _startOn;
     return retval;
 }
 
+// Creates a socket of the given protocol and connects it to the given host and port.
+// Returns the socket or SOCKET_FAIL in case of error.
+int Sodaq_3Gbee::openSocket(Protocols protocol, const char* host, uint16_t port)
+{
+    if (!connectSharingSockets()) {
+        return SOCKET_FAIL;
+    }
+
+    int socket = createSocket(protocol);
+    if (socket < 0) {
+        return SOCKET_FAIL;
+    }
+
+    if (!connectSocket(socket, host, port)) {
+        closeSocket(socket);
+        return SOCKET_FAIL;
+    }
+
+    return socket;
+}
+
+const SocketInfo_t* Sodaq_3Gbee::getSocketInfo(uint8_t socket) const
+{
+    if (socket >= ARRAY_SIZE(_sockets)) {
+        return NULL;
+    }
+
+    return &_sockets[socket];
+}
+
+uint8_t Sodaq_3Gbee::getOpenSocketCount() const
+{
+    uint8_t count = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(_sockets); i++) {
+        if (_sockets[i].state != SocketFree) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void Sodaq_3Gbee::resetSockets()
+{
+    memset(_sockets, 0, sizeof(_sockets));
+    for (size_t i = 0; i < ARRAY_SIZE(_sockets); i++) {
+        _sockets[i].closed = true;
+    }
+    _writeBufferCount = 0;
+}
+
+// connect() starts with a disconnect, which would drop the sockets that are open.
+// So it is skipped while sockets are using the data connection.
+bool Sodaq_3Gbee::connectSharingSockets()
+{
+    if (getOpenSocketCount() > 0) {
+        if (isConnected()) {
+            return true;
+        }
+
+        // The table is stale, e.g. the modem was switched off
+        resetSockets();
+    }
+
+    return connect();
+}
+
 // Blocks waiting for the given socket to be reported closed.
 // This method should be called only after closeSocket() or when the remote is expected to close the socket.
 // Times out after 60 seconds.
@@ -1787,8 +2991,9 @@ void Sodaq_3Gbee::waitForSocketClose(uint8_t socket, uint32_t timeout)
     debugPrintLn(socket);
 
     uint32_t start = millis();
-    while (isAlive() && (!_socketClosedBit[socket]) && (!is_timedout(start, timeout))) {
-        delay(5);
+    while ((socket < ARRAY_SIZE(_sockets)) && (!_sockets[socket].closed) && (!is_timedout(start, timeout))) {
+        pollIdle();
+        sodaq_wdt_reset();
     }
 }
 
@@ -1812,6 +3017,83 @@ ResponseTypes Sodaq_3Gbee::_usoctlParser(ResponseTypes& response, const char* bu
     return ResponseError;
 }
 
+// Returns the number of bytes sent on the given socket that are not acknowledged
+// by the remote yet, or -1 in case of error.
+int32_t Sodaq_3Gbee::getSocketUnackedBytes(uint8_t socket)
+{
+    if (socket >= ARRAY_SIZE(_sockets)) {
+        return -1;
+    }
+
+    print("AT+USOCTL=");
+    print(socket);
+    println(",11");
+
+    uint16_t value;
+    if (readResponse<uint16_t, uint8_t>(_usoctlParser, &value, NULL) != ResponseOK) {
+        return -1;
+    }
+
+    _sockets[socket].unackedBytes = value;
+    return value;
+}
+
+void Sodaq_3Gbee::watchSocketOutput(uint8_t socket, SocketDrainedCallbackPtr callback, void* parameter)
+{
+    if (socket >= ARRAY_SIZE(_sockets)) {
+        return;
+    }
+
+    _sockets[socket].drainedCallback = callback;
+    _sockets[socket].drainedParameter = parameter;
+}
+
+// Called from poll(), when no asynchronous command is pending
+void Sodaq_3Gbee::sampleSocketOutput()
+{
+    if (!is_timedout(_lastOutputSample, SOCKET_OUTPUT_SAMPLE_INTERVAL)) {
+        return;
+    }
+
+    // Take turns if several sockets are watched
+    for (uint8_t i = 1; i <= ARRAY_SIZE(_sockets); i++) {
+        uint8_t socket = (_outputSampleSocket + i) % ARRAY_SIZE(_sockets);
+        if (_sockets[socket].drainedCallback) {
+            char command[20];
+            snprintf(command, sizeof(command), "AT+USOCTL=%d,11", socket);
+
+            _outputSampleSocket = socket;
+            _lastOutputSample = NOW;
+            sendCommandAsync<uint16_t, uint8_t>(command, DEFAULT_READ_MS, _usoctlParser,
+                    &_outputSampleValue, NULL, _socketOutputSampled, this);
+            return;
+        }
+    }
+}
+
+void Sodaq_3Gbee::_socketOutputSampled(ResponseTypes response, void* parameter)
+{
+    Sodaq_3Gbee* modem = static_cast<Sodaq_3Gbee*>(parameter);
+    uint8_t socket = modem->_outputSampleSocket;
+    SocketInfo_t& info = modem->_sockets[socket];
+
+    if (response == ResponseError) {
+        // Most likely the socket is gone, stop watching it
+        info.drainedCallback = NULL;
+        return;
+    }
+    if (response != ResponseOK) {
+        return;
+    }
+
+    info.unackedBytes = modem->_outputSampleValue;
+    if (info.unackedBytes == 0 && info.drainedCallback) {
+        SocketDrainedCallbackPtr callback = info.drainedCallback;
+        info.drainedCallback = NULL;
+        callback(socket, info.drainedParameter);
+    }
+}
+
 // Wait until no more unacknowledged socket output
 bool Sodaq_3Gbee::waitForSocketOutput(uint8_t socket, uint32_t timeout)
 {
@@ -1828,6 +3110,9 @@ bool Sodaq_3Gbee::waitForSocketOutput(uint8_t socket, uint32_t timeout)
         // parse +USOCTL: 0,11,0
         uint16_t value;
         if (readResponse<uint16_t, uint8_t>(_usoctlParser, &value, NULL) == ResponseOK) {
+            if (socket < ARRAY_SIZE(_sockets)) {
+                _sockets[socket].unackedBytes = value;
+            }
             if (value == 0) {
                 retval = true;
                 break;
@@ -1851,7 +3136,7 @@ bool Sodaq_3Gbee::openTCP(const char *apn, const char *apnuser, const char *apnp
     bool retval = false;
     if (on()) {
         setApn(apn, apnuser, apnpwd);
-        if (connect()) {
+        if (connectSharingSockets()) {
             // IP_t ip = getHostIP(server);
             _openTCPsocket = createSocket(TCP);
             // TODO Use ip instead of hostname
@@ -1871,7 +3156,7 @@ bool Sodaq_3Gbee::openTCP(const char *server, int port, bool transMode)
     // TODO Verify this
     bool retval = false;
     if (on()) {
-        if (connect()) {
+        if (connectSharingSockets()) {
             // IP_t ip = getHostIP(server);
             _openTCPsocket = createSocket(TCP);
             // TODO Use ip instead of hostname
@@ -1890,11 +3175,14 @@ void Sodaq_3Gbee::closeTCP(bool switchOff)
 {
     // TODO Verify this
     if (_openTCPsocket >= 0) {
-        closeSocket(_openTCPsocket);
+        if (!closeSocket(_openTCPsocket)) {
+            // The socket is not used anymore, it must not keep the modem on
+            _sockets[_openTCPsocket].state = SocketFree;
+        }
         //waitForSocketClose(_openTCPsocket);
         _openTCPsocket = -1;
     }
-    if (switchOff) {
+    if (switchOff && getOpenSocketCount() == 0) {
         off();
     }
 }
@@ -1936,38 +3224,11 @@ size_t Sodaq_3Gbee::httpRequest(const char* server, uint16_t port,
 {
     // TODO maybe return error <0 ?
 
-    // reset http profile 0
-    println("AT+UHTTP=0");
-    if (readResponse() != ResponseOK) {
-        return 0;
-    }
-
-    deleteFile(HTTP_RECEIVE_FILENAME); // cleanup the file first (if exists)
-
     if (requestType >= HttpRequestTypesMAX) {
         debugPrintLn(DEBUG_STR_ERROR "Unknown request type!");
         return 0;
     }
 
-    // set server host name
-    print("AT+UHTTP=0,");
-    print(isValidIPv4(server) ? "0,\"" : "1,\"");
-    print(server);
-    println("\"");
-    if (readResponse() != ResponseOK) {
-        return 0;
-    }
-
-    // set port
-    if (port != 80) {
-        print("AT+UHTTP=0,5,");
-        println(port);
-
-        if (readResponse() != ResponseOK) {
-            return 0;
-        }
-    }
-
     // before starting the actual http request, create any files needed in the fs of the modem
     // that way there is a chance to abort sending the http req command in case of an fs error
     if (requestType == PUT || requestType == POST) {
@@ -1984,6 +3245,29 @@ size_t Sodaq_3Gbee::httpRequest(const char* server, uint16_t port,
         }
     }
 
+    return sendHttpRequest(server, port, endpoint, requestType, HTTP_SEND_TMP_FILENAME, _httpContentType,
+            responseBuffer, responseSize);
+}
+
+// Sends an HTTP POST with the contents of the given file on the modem as body.
+size_t Sodaq_3Gbee::httpPostFile(const char* server, uint16_t port, const char* endpoint,
+        const char* filename, HttpContentTypes contentType,
+        char* responseBuffer, size_t responseSize)
+{
+    return sendHttpRequest(server, port, endpoint, POST, filename, contentType, responseBuffer, responseSize);
+}
+
+// Sends the HTTP request with AT+UHTTPC and waits for the result.
+// The body of a PUT or POST is the given file on the modem.
+size_t Sodaq_3Gbee::sendHttpRequest(const char* server, uint16_t port, const char* endpoint,
+        HttpRequestTypes requestType, const char* sendFilename, HttpContentTypes contentType,
+        char* responseBuffer, size_t responseSize)
+{
+    _httpResponseParsed = TriBoolUndefined;
+    if (!setHttpProfile(server, port)) {
+        return 0;
+    }
+
     // reset the success bit before calling a new request
     _httpRequestSuccessBit[requestType] = TriBoolUndefined;
 
@@ -1993,34 +3277,33 @@ size_t Sodaq_3Gbee::httpRequest(const char* server, uint16_t port,
     print(endpoint);
     print("\",\"\""); // empty filename = default = "http_last_response_0" (DEFAULT_HTTP_RECEIVE_FILENAME)
 
-    // NOTE: a file that includes the buffer to send has been created already
+    // NOTE: the file with the body to send has been created already
     if (requestType == PUT) {
-        print(",\"" HTTP_SEND_TMP_FILENAME "\""); // param1: file from filesystem to send
+        print(",\"");
+        print(sendFilename); // param1: file from filesystem to send
+        print("\"");
     }
     else if (requestType == POST) {
-        print(",\"" HTTP_SEND_TMP_FILENAME "\""); // param1: file from filesystem to send
-        print(",1"); // param2: content type, 1=text/plain
-        // TODO consider making the content type a parameter
+        print(",\"");
+        print(sendFilename); // param1: file from filesystem to send
+        print("\",");
+        print(contentType); // param2: content type
     } else {
         // GET, etc
     }
     println("");
 
     if (readResponse() != ResponseOK) {
+        clearCachedHttpProfile();
         return 0;
     }
 
     // check for success while checking URCs
-    // This loop relies on readResponse being called via isAlive()
+    // This loop relies on the URC's being handled by poll()
     uint32_t start = millis();
-    uint32_t delay_count = 50;
     while ((_httpRequestSuccessBit[requestType] == TriBoolUndefined) && !is_timedout(start, 60000)) {
-        isAlive();
-        sodaq_wdt_safe_delay(delay_count);
-        // Next time wait a little longer, but not longer than 5 seconds
-        if (delay_count < 5000) {
-            delay_count += 250;
-        }
+        pollIdle();
+        sodaq_wdt_reset();
     }
 
     if (_httpRequestSuccessBit[requestType] == TriBoolTrue) {
@@ -2038,16 +3321,70 @@ size_t Sodaq_3Gbee::httpRequest(const char* server, uint16_t port,
     }
     else if (_httpRequestSuccessBit[requestType] == TriBoolFalse) {
         debugPrintLn(DEBUG_STR_ERROR "An error occurred with the http request!");
+        clearCachedHttpProfile();
         return 0;
     }
     else {
         debugPrintLn(DEBUG_STR_ERROR "Timed out waiting for a response for the http request!");
+        clearCachedHttpProfile();
         return 0;
     }
 
     return 0;
 }
 
+/**
+ * Configure HTTP profile 0 for the given server
+ *
+ * The configuration is skipped if the profile already has the same server
+ * and port, and the modem wasn't switched off or on since then. The response file
+ * is not deleted either in that case, AT+UHTTPC overwrites it.
+ */
+bool Sodaq_3Gbee::setHttpProfile(const char* server, uint16_t port)
+{
+    if (_httpProfilePort == port && _httpProfilePowerCycle == _powerCycleCount
+            && _httpProfileHost && strcmp(_httpProfileHost, server) == 0) {
+        return true;
+    }
+    clearCachedHttpProfile();
+
+    // reset http profile 0
+    println("AT+UHTTP=0");
+    if (readResponse() != ResponseOK) {
+        return false;
+    }
+
+    deleteFile(HTTP_RECEIVE_FILENAME); // cleanup the file first (if exists)
+
+    // set server host name
+    print("AT+UHTTP=0,");
+    print(isValidIPv4(server) ? "0,\"" : "1,\"");
+    print(server);
+    println("\"");
+    if (readResponse() != ResponseOK) {
+        return false;
+    }
+
+    // set port
+    if (port != 80) {
+        print("AT+UHTTP=0,5,");
+        println(port);
+
+        if (readResponse() != ResponseOK) {
+            return false;
+        }
+    }
+
+    if (!_httpProfileHost || strcmp(_httpProfileHost, server) != 0) {
+        _httpProfileHost = static_cast<char*>(realloc(_httpProfileHost, strlen(server) + 1));
+        strcpy(_httpProfileHost, server);
+    }
+    _httpProfilePort = port;
+    _httpProfilePowerCycle = _powerCycleCount;
+
+    return true;
+}
+
 /**
  * A convenience wrapper function to just a simple HTTP GET
  *
@@ -2069,75 +3406,131 @@ uint32_t Sodaq_3Gbee::httpGet(const char* server, uint16_t port, const char* end
     }
 
     // Find out the header size
-    _httpGetHeaderSize = httpGetHeaderSize(HTTP_RECEIVE_FILENAME);
-    debugPrintLn(String("[httpGet] header size: ") + _httpGetHeaderSize);
-    if (_httpGetHeaderSize == 0) {
+    const HttpResponseInfo_t* info = httpGetResponseInfo();
+    if (!info) {
         return 0;
     }
+    debugPrintLn(String("[httpGet] header size: ") + info->bodyOffset);
 
     if (!buffer) {
-        return file_size - _httpGetHeaderSize;
+        return file_size - info->bodyOffset;
     }
 
     // Fill the buffer starting from the header
-    return sodaq_3gbee.readFilePartial(HTTP_RECEIVE_FILENAME, (uint8_t *)buffer, bufferSize, _httpGetHeaderSize);
+    return sodaq_3gbee.readFilePartial(HTTP_RECEIVE_FILENAME, (uint8_t *)buffer, bufferSize, info->bodyOffset);
 }
 
 /**
  * Return the size of the HTTP response header
  *
- * This function searches from the start of the file until two CRLFs have
- * been seen.
+ * See httpParseResponseHeader().
  * The file is left unmodified.
  */
 uint32_t Sodaq_3Gbee::httpGetHeaderSize(const char * filename)
 {
-    bool status;
-
-    uint32_t file_size;
-    status = sodaq_3gbee.getFileSize(filename, file_size);
-    if (!status) {
+    HttpResponseInfo_t info;
+    if (!httpParseResponseHeader(filename, info)) {
         return 0;
     }
 
-    int state = 0;      // 0 nothing, 1=CR, 2=CRLF, 3=CRLFCR, 4=CRLFCRLF
-    uint8_t buffer[64];
-    uint32_t offset = 0;
-    while (offset < file_size && state != 4) {
-        size_t len = sizeof(buffer);
-        size_t size;
-        size = sodaq_3gbee.readFilePartial(filename, buffer, sizeof(buffer), offset);
-
-        size_t ix;
-        for (ix = 0; state != 4 && ix < sizeof(buffer); ix++) {
-            if ((state == 0 || state == 2) && buffer[ix] == '\r') {
-                state++;
-            } else if ((state == 1 || state == 3) && buffer[ix] == '\n') {
-                state++;
-            } else {
-                state = 0;
+    return info.bodyOffset;
+}
+
+/**
+ * Parse the header of an HTTP response file
+ *
+ * The file is read through a Sodaq_3GbeeModemFile with a buffer of
+ * HTTP_HEADER_BLOCK_SIZE, which is usually just one AT+URDBLOCK for the
+ * whole header. Each line is parsed as it is read, until the empty line
+ * that ends the header. Lines longer than HTTP_HEADER_LINE_SIZE are
+ * truncated.
+ */
+bool Sodaq_3Gbee::httpParseResponseHeader(const char* filename, HttpResponseInfo_t& info)
+{
+    memset(&info, 0, sizeof(info));
+    info.contentLength = -1;
+
+    uint8_t block[HTTP_HEADER_BLOCK_SIZE];
+    Sodaq_3GbeeModemFile file(block, sizeof(block), *this);
+    if (!file.open(filename)) {
+        return false;
+    }
+    info.fileSize = file.size();
+
+    char line[HTTP_HEADER_LINE_SIZE + 1];
+    for (;;) {
+        size_t len = 0;
+        int c;
+        while ((c = file.read()) >= 0 && c != '\n') {
+            if (len < sizeof(line) - 1) {
+                line[len++] = c;
             }
         }
-        if (state == 4) {
-            return offset + ix;
+        if (c < 0) {
+            // The file ends in the middle of the header
+            return false;
+        }
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
+        line[len] = '\0';
+
+        if (len == 0) {
+            // The end of the header
+            info.bodyOffset = file.position();
+            return info.statusCode != 0;
+        } else if (info.statusCode == 0) {
+            // HTTP/1.1 200 OK
+            int statusCode;
+            if (sscanf(line, "HTTP/%*s %d", &statusCode) != 1) {
+                return false;
+            }
+            info.statusCode = statusCode;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            info.contentLength = strtol(&line[15], NULL, 10);
+        } else if (strncasecmp(line, "Content-Type:", 13) == 0) {
+            const char* value = &line[13];
+            while (*value == ' ') {
+                value++;
+            }
+            strncpy(info.contentType, value, sizeof(info.contentType) - 1);
         }
+        sodaq_wdt_reset();
+    }
+}
 
-        offset += size;
+size_t Sodaq_3Gbee::httpGetPartial(uint8_t* buffer, size_t size, uint32_t offset)
+{
+    uint32_t bodyOffset = httpGetBodyOffset();
+    if (bodyOffset == 0) {
+        // Don't trust a file without HTTP response header
+        return 0;
     }
+    return readFilePartial(HTTP_RECEIVE_FILENAME, buffer, size, bodyOffset + offset);
+}
 
-    return 0;
+uint32_t Sodaq_3Gbee::httpGetBodyOffset()
+{
+    const HttpResponseInfo_t* info = httpGetResponseInfo();
+    return info ? info->bodyOffset : 0;
 }
 
-size_t Sodaq_3Gbee::httpGetPartial(uint8_t* buffer, size_t size, uint32_t offset)
+const HttpResponseInfo_t* Sodaq_3Gbee::httpGetResponseInfo()
 {
-    if (_httpGetHeaderSize == 0) {
-        _httpGetHeaderSize = httpGetHeaderSize(HTTP_RECEIVE_FILENAME);
+    if (_httpResponseParsed == TriBoolUndefined) {
+        bool ok = httpParseResponseHeader(HTTP_RECEIVE_FILENAME, _httpResponseInfo);
+        _httpResponseParsed = ok ? TriBoolTrue : TriBoolFalse;
     }
-    if (_httpGetHeaderSize == 0) {
-        // Don't trust a file without HTTP response header
+    return (_httpResponseParsed == TriBoolTrue) ? &_httpResponseInfo : NULL;
+}
+
+uint32_t Sodaq_3Gbee::httpGetChunks(uint8_t* buffer, size_t size, FileChunkCallbackPtr callback, void* parameter)
+{
+    uint32_t bodyOffset = httpGetBodyOffset();
+    if (bodyOffset == 0) {
         return 0;
     }
-    return readFilePartial(HTTP_RECEIVE_FILENAME, buffer, size, _httpGetHeaderSize + offset);
+    return readFileChunks(HTTP_RECEIVE_FILENAME, buffer, size, callback, parameter, bodyOffset);
 }
 
 // maps the given requestType to the index the modem recognizes, -1 if error
@@ -2171,7 +3564,8 @@ int Sodaq_3Gbee::_httpModemIndexToRequestType(uint8_t modemIndex)
 // Opens an FTP connection.
 bool Sodaq_3Gbee::openFtpConnection(const char* server, const char* username, const char* password, FtpModes ftpMode)
 {
-    ftpDirectoryChangeCounter = 0;
+    ftpPath[0] = '\0';
+    ftpReceiveCached = false;
 
     // set server
     print("AT+UFTP=");
@@ -2222,7 +3616,8 @@ bool Sodaq_3Gbee::openFtpConnection(const char* server, const char* username, co
 // Closes the FTP connection.
 bool Sodaq_3Gbee::closeFtpConnection()
 {
-    ftpDirectoryChangeCounter = 0;
+    ftpPath[0] = '\0';
+    ftpReceiveCached = false;
 
     println("AT+UFTPC=0");
 
@@ -2235,29 +3630,19 @@ bool Sodaq_3Gbee::closeFtpConnection()
 
 // Opens an FTP file for sending or receiving.
 // filename should be limited to 256 characters (excl. null terminator)
-// path should be limited to 512 characters (excl. null temrinator)
+// path should be limited to 128 characters (excl. null terminator)
 bool Sodaq_3Gbee::openFtpFile(const char* filename, const char* path)
 {
+    ftpFilename[0] = '\0';
+    ftpReceiveCached = false;
+    if (!setFtpPath(path)) {
+        return false;
+    }
+
     // keep the filename for subsequent calls to send or receive data
     strncpy(ftpFilename, filename, sizeof(ftpFilename)-1);
     ftpFilename[sizeof(ftpFilename) - 1] = 0; // always null terminated, even when given filename has length > sizeof(ftpFilename)-1
 
-    resetFtpDirectoryIfNeeded();
-    if (path) {
-        char pathBuffer[512 + 1];
-        strncpy(pathBuffer, path, sizeof(pathBuffer)-1);
-        pathBuffer[sizeof(pathBuffer) - 1] = '\0'; // secure from overflow
-
-        char* pathPointer = strtok(pathBuffer, "/");
-        while (pathPointer != NULL)
-        {
-            if (!changeFtpDirectory(pathPointer)) {
-                // TODO do something here?
-            }
-            pathPointer = strtok(NULL, "/");
-        }
-    }
-
     return true;
 }
 
@@ -2269,28 +3654,121 @@ bool Sodaq_3Gbee::ftpSend(const char* buffer)
     return ftpSend((uint8_t*)buffer, strlen(buffer));
 }
 
-// Sends the given "buffer" to the (already) open FTP file.
-// Returns true if successful.
-// Fails immediately if there is no open FTP file.
-bool Sodaq_3Gbee::ftpSend(const uint8_t* buffer, size_t size)
+// Sends the given "buffer" to the (already) open FTP file.
+// Returns true if successful.
+// Fails immediately if there is no open FTP file.
+bool Sodaq_3Gbee::ftpSend(const uint8_t* buffer, size_t size)
+{
+    // quick sanity check
+    if (ftpFilename[0] == '\0') {
+        return false;
+    }
+
+    deleteFile(FTP_TMP_FILENAME); // cleanup
+
+    if (!writeFile(FTP_TMP_FILENAME, buffer, size)) {
+        deleteFile(FTP_TMP_FILENAME);
+        return false;
+    }
+
+    return storeFtpTmpFile();
+}
+
+// Sends the data of the producer to the (already) open FTP file.
+// The buffer is used to collect the data in the temp file on the modem.
+// Returns true if successful.
+bool Sodaq_3Gbee::ftpSend(DataProducerPtr producer, void* parameter, uint8_t* buffer, size_t size)
+{
+    if (!producer || !buffer || size == 0 || !ftpSendBegin()) {
+        return false;
+    }
+
+    size_t count;
+    while ((count = producer(buffer, size, parameter)) > 0) {
+        if (!ftpSendAppend(buffer, count)) {
+            deleteFile(FTP_TMP_FILENAME);
+            return false;
+        }
+    }
+
+    return ftpSendEnd();
+}
+
+// Sends "length" bytes of the stream to the (already) open FTP file.
+// The buffer is used to collect the data in the temp file on the modem.
+// Returns true if successful, nothing is stored if the stream times out.
+bool Sodaq_3Gbee::ftpSend(Stream& stream, uint32_t length, uint8_t* buffer, size_t size)
+{
+    if (!buffer || size == 0 || !ftpSendBegin()) {
+        return false;
+    }
+
+    while (length > 0) {
+        size_t count = (length < size) ? length : size;
+        if (stream.readBytes(buffer, count) != count || !ftpSendAppend(buffer, count)) {
+            deleteFile(FTP_TMP_FILENAME);
+            return false;
+        }
+        length -= count;
+    }
+
+    return ftpSendEnd();
+}
+
+// Starts collecting the data for the (already) open FTP file.
+// Fails immediately if there is no open FTP file.
+bool Sodaq_3Gbee::ftpSendBegin()
+{
+    // quick sanity check
+    if (ftpFilename[0] == '\0') {
+        return false;
+    }
+
+    deleteFile(FTP_TMP_FILENAME); // cleanup
+
+    return true;
+}
+
+// Appends the buffer to the data collected for the (already) open FTP file.
+bool Sodaq_3Gbee::ftpSendAppend(const uint8_t* buffer, size_t size)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    // AT+UDWNFILE appends to the existing temp file
+    bool status = writeFile(FTP_TMP_FILENAME, buffer, size);
+    sodaq_wdt_reset();
+
+    return status;
+}
+
+// Sends the collected data to the (already) open FTP file.
+bool Sodaq_3Gbee::ftpSendEnd()
 {
     // quick sanity check
     if (ftpFilename[0] == '\0') {
         return false;
     }
 
-    deleteFile(FTP_TMP_FILENAME); // cleanup
+    bool status = storeFtpTmpFile();
+    deleteFile(FTP_TMP_FILENAME);
 
-    if (!writeFile(FTP_TMP_FILENAME, buffer, size)) {
-        deleteFile(FTP_TMP_FILENAME);
-        return false;
-    }
+    return status;
+}
+
+// Stores the temp file as the open FTP file on the server.
+bool Sodaq_3Gbee::storeFtpTmpFile()
+{
+    // A large file needs more time, allow for an uplink of 1 kB/s
+    uint32_t size = 0;
+    getFileSize(FTP_TMP_FILENAME, size);
 
     print("AT+UFTPC=5,\"" FTP_TMP_FILENAME "\",\"");
     print(ftpFilename);
     println("\"");
 
-    if ((readResponse() != ResponseOK) || (!waitForFtpCommandResult(5))) {
+    if ((readResponse() != ResponseOK) || (!waitForFtpCommandResult(5, 10000 + size))) {
         return false;
     }
 
@@ -2320,12 +3798,67 @@ int Sodaq_3Gbee::ftpReceive(char* buffer, size_t size)
     return readFile(FTP_TMP_FILENAME, (uint8_t*)buffer, size);
 }
 
+// The parameter of _ftpReceiveChunk()
+struct FtpReceiveParameter_t {
+    FileChunkCallbackPtr callback;
+    void* parameter;
+    ProgressCallbackPtr progress;
+    uint32_t total;
+};
+
+// Streams the (already) open FTP file, from the given offset, to the callback.
+// Returns the number of bytes handed to the callback.
+uint32_t Sodaq_3Gbee::ftpReceive(uint8_t* buffer, size_t size, FileChunkCallbackPtr callback, void* parameter,
+        uint32_t offset, ProgressCallbackPtr progress)
+{
+    // quick sanity check
+    if (ftpFilename[0] == '\0' || !buffer || size == 0 || !callback) {
+        return 0;
+    }
+
+    if (!ftpReceiveCached) {
+        deleteFile(FTP_RECEIVE_FILENAME); // cleanup
+
+        print("AT+UFTPC=4,\"");
+        print(ftpFilename);
+        println("\",\"" FTP_RECEIVE_FILENAME "\"");
+
+        if ((readResponse() != ResponseOK) || (!waitForFtpCommandResult(4, FTP_RECEIVE_TIMEOUT))) {
+            return 0;
+        }
+        ftpReceiveCached = true;
+    }
+
+    if (!progress) {
+        return readFileChunks(FTP_RECEIVE_FILENAME, buffer, size, callback, parameter, offset);
+    }
+
+    FtpReceiveParameter_t receiveParameter = { callback, parameter, progress, 0 };
+    if (!getFileSize(FTP_RECEIVE_FILENAME, receiveParameter.total)) {
+        return 0;
+    }
+
+    return readFileChunks(FTP_RECEIVE_FILENAME, buffer, size, _ftpReceiveChunk, &receiveParameter, offset);
+}
+
+// Hands a chunk of the FTP file to the callback of ftpReceive() and reports the progress.
+bool Sodaq_3Gbee::_ftpReceiveChunk(const uint8_t* buffer, size_t size, uint32_t offset, void* parameter)
+{
+    FtpReceiveParameter_t* receiveParameter = static_cast<FtpReceiveParameter_t*>(parameter);
+
+    if (!receiveParameter->callback(buffer, size, offset, receiveParameter->parameter)) {
+        return false;
+    }
+    receiveParameter->progress(offset + size, receiveParameter->total, receiveParameter->parameter);
+
+    return true;
+}
+
 // Closes the open FTP file.
+// The current directory is kept, for the next file in the same directory.
 // Returns true if successful.
-// Fails immediatelly if there is no open FTP file.
 bool Sodaq_3Gbee::closeFtpFile()
 {
-    resetFtpDirectoryIfNeeded();
     ftpFilename[0] = '\0'; // invalidate the filename
     return true;
 }
@@ -2446,7 +3979,35 @@ bool Sodaq_3Gbee::closeMQTT(bool switchOff)
 
 bool Sodaq_3Gbee::sendMQTTPacket(uint8_t * pckt, size_t len)
 {
-    return sendDataTCP(pckt, len);
+    if (_openTCPsocket < 0) {
+        return false;
+    }
+
+    if (!_mqttPacketBuffering) {
+        return sendDataTCP(pckt, len);
+    }
+
+    // Small packets, like publishes, are merged into one AT+USOWR.
+    // They are sent by availableMQTTPacket() and receiveMQTTPacket() at the latest.
+    return socketWrite(_openTCPsocket, pckt, len);
+}
+
+// Sends the packets buffered by sendMQTTPacket().
+// The packets were already reported as sent, so a failure closes the connection.
+bool Sodaq_3Gbee::flushMQTTPackets()
+{
+    if (socketFlush(_openTCPsocket)) {
+        return true;
+    }
+
+    debugPrintLn("[flushMQTTPackets]: the buffered packets could not be sent, closing");
+    discardSocketWrites(_openTCPsocket);
+    closeTCP(false);
+    if (_tcpClosedHandler) {
+        _tcpClosedHandler();
+    }
+
+    return false;
 }
 
 /*
@@ -2457,11 +4018,16 @@ bool Sodaq_3Gbee::sendMQTTPacket(uint8_t * pckt, size_t len)
  */
 size_t Sodaq_3Gbee::receiveMQTTPacket(uint8_t * pckt, size_t size, uint32_t timeout)
 {
-    // TODO While loop until packet received, or timed out
-    isAlive();
+    pollInput();
     if (_openTCPsocket < 0) {
         return 0;
     }
+
+    // A reply can only be expected after the buffered packets are sent
+    if (!flushMQTTPackets()) {
+        return 0;
+    }
+
     size_t retval = 0;
     uint32_t start = millis();
     while (!is_timedout(start, timeout)) {
@@ -2480,6 +4046,8 @@ size_t Sodaq_3Gbee::receiveMQTTPacket(uint8_t * pckt, size_t size, uint32_t time
                 break;
             }
         }
+        pollIdle();
+        sodaq_wdt_reset();
     }
     return retval;
 }
@@ -2500,10 +4068,16 @@ bool Sodaq_3Gbee::isAliveMQTT()
  */
 size_t Sodaq_3Gbee::availableMQTTPacket()
 {
-    isAlive();
+    pollInput();
     if (_openTCPsocket < 0) {
         return 0;
     }
+
+    // Send the packets buffered by sendMQTTPacket()
+    if (!flushMQTTPackets()) {
+        return 0;
+    }
+
     return socketBytesPending(_openTCPsocket);
 }
 
@@ -2512,6 +4086,115 @@ size_t Sodaq_3Gbee::availableMQTTPacket()
 ////////////////////////////////////////////////////////////////////////////////
 
 
+/**
+ * Read the header of a response which is followed by a quoted block of data
+ *
+ * For example
+ *   +URDBLOCK: http_last_response_0,86,"..."
+ * Everything up to and including the opening quote is read. The header must
+ * contain the given literal. The last number of the header, which is the size
+ * of the data block, is returned in "size".
+ */
+bool Sodaq_3Gbee::readDataPrefix(const char* literal, char*& header, size_t& len, uint32_t timeout)
+{
+    if (!readUntilView('"', header, len, timeout)) {
+        return false;
+    }
+
+    // complete lines before the header are URC's (e.g. +UUSORD) that
+    // would otherwise be lost
+    char* eol;
+    while ((eol = strchr(header, '\n')) != NULL) {
+        size_t lineLen = eol - header;
+        *eol = '\0';
+        if (lineLen > 0 && header[lineLen - 1] == '\r') {
+            header[--lineLen] = '\0';
+        }
+        if (lineLen > 0 && header[0] == '+') {
+            dispatchUrc(header, lineLen);
+        }
+        header = eol + 1;
+    }
+    len = strlen(header);
+
+    if (strstr(header, literal) == NULL) {
+        debugPrint(DEBUG_STR_ERROR);
+        debugPrint(literal);
+        debugPrintLn(" literal is missing!");
+        return false;
+    }
+
+    return true;
+}
+
+bool Sodaq_3Gbee::readDataHeader(const char* literal, uint32_t& size, uint32_t timeout)
+{
+    char* header;
+    size_t len;
+    if (!readDataPrefix(literal, header, len, timeout)) {
+        return false;
+    }
+
+    // Quoted fields (such as the filename of +URDFILE) can come before the data,
+    // the data starts at the quote right after "<size>,"
+    for (uint8_t i = 0; i < 4; i++) {
+        if (i > 0 && !readUntilView('"', header, len, timeout)) {
+            break;
+        }
+
+        if (len < 2 || header[len - 1] != ',') {
+            continue;
+        }
+        header[--len] = '\0';
+        char* sizeField = strrchr(header, ',');
+        sizeField = sizeField ? sizeField + 1 : header;
+        if (*sizeField == '\0' || strspn(sizeField, "0123456789") != strlen(sizeField)) {
+            continue;
+        }
+
+        size = strtoul(sizeField, NULL, 10);
+        return true;
+    }
+
+    debugPrintLn(DEBUG_STR_ERROR "Could not parse the data size!");
+    return false;
+}
+
+int Sodaq_3Gbee::readSocketData(const char* literal, uint8_t* buffer, size_t size)
+{
+    uint32_t count;
+    if (!readDataHeader(literal, count)) {
+        return -1;
+    }
+
+    return readSocketPayload(buffer, size, count);
+}
+
+int Sodaq_3Gbee::readSocketPayload(uint8_t* buffer, size_t size, size_t count)
+{
+    if (count > size) {
+        debugPrintLn(DEBUG_STR_ERROR "The data does not fit in the buffer!");
+        return -1;
+    }
+
+    size_t received = _socketBinaryMode ? readBytes(buffer, count) : readHexBytes(buffer, count);
+    if (received != count) {
+        debugPrintLn(DEBUG_STR_ERROR "Timed out reading the data!");
+        return -1;
+    }
+
+    // closing quote
+    if (timedRead() != '"') {
+        return -1;
+    }
+
+    if (readResponse() != ResponseOK) {
+        return -1;
+    }
+
+    return count;
+}
+
 /**
  * Read a file from the UBlox device
  */
@@ -2545,26 +4228,10 @@ size_t Sodaq_3Gbee::readFile(const char* filename, uint8_t* buffer, size_t size)
     char checkChar = 0;
     size_t len = 0;
 
-    // reply identifier
-    len = readBytesUntil(' ', _inputBuffer, _inputBufferSize);
-    if (len == 0 || strstr(_inputBuffer, "+URDFILE:") == NULL) {
-        debugPrintLn(DEBUG_STR_ERROR "+URDFILE literal is missing!");
-        goto error;
-    }
-
-    // filename
-    len = readBytesUntil(',', _inputBuffer, _inputBufferSize);
-    // TODO check filename after removing quotes and escaping chars
-    //if (len == 0 || strstr(_inputBuffer, filename)) {
-    //    debugPrintLn(DEBUG_STR_ERROR "Filename reported back is not correct!");
-    //    return 0;
-    //}
-
-    // filesize
-    len = readBytesUntil(',', _inputBuffer, _inputBufferSize);
+    // reply identifier, filename and filesize, up to the opening quote of the data
+    //   +URDFILE: "test_file",42,"..."
     filesize = 0; // reset the var before reading from reply string
-    if (sscanf(_inputBuffer, "%lu", &filesize) != 1) {
-        debugPrintLn(DEBUG_STR_ERROR "Could not parse the file size!");
+    if (!readDataHeader("+URDFILE:", filesize)) {
         goto error;
     }
     if (filesize == 0 || filesize > size) {
@@ -2572,13 +4239,6 @@ size_t Sodaq_3Gbee::readFile(const char* filename, uint8_t* buffer, size_t size)
         goto error;
     }
 
-    // opening quote character
-    checkChar = timedRead();
-    if (checkChar != '"') {
-        debugPrintLn(DEBUG_STR_ERROR "Missing starting character (quote)!");
-        goto error;
-    }
-
     // actual file buffer, written directly to the provided result buffer
     len = readBytes(buffer, filesize);
     if (len != filesize) {
@@ -2642,24 +4302,11 @@ size_t Sodaq_3Gbee::readFilePartial(const char* filename, uint8_t* buffer, size_
     size_t len = 0;
     uint32_t blocksize;
 
-    // reply identifier
+    // reply identifier, filename and the number of bytes, up to the opening quote
     //   +URDBLOCK: http_last_response_0,86,"..."
     // where 86 is an example of the size
-    len = readBytesUntil(' ', _inputBuffer, _inputBufferSize);
-    if (len == 0 || strstr(_inputBuffer, "+URDBLOCK:") == NULL) {
-        debugPrintLn(DEBUG_STR_ERROR "+URDBLOCK literal is missing!");
-        goto error;
-    }
-
-    // skip filename
-    len = readBytesUntil(',', _inputBuffer, _inputBufferSize);
-    // TODO check filename. Note, there are no quotes
-
-    // read the number of bytes
-    len = readBytesUntil(',', _inputBuffer, _inputBufferSize);
     blocksize = 0; // reset the var before reading from reply string
-    if (sscanf(_inputBuffer, "%lu", &blocksize) != 1) {
-        debugPrintLn(DEBUG_STR_ERROR "Could not parse the block size!");
+    if (!readDataHeader("+URDBLOCK:", blocksize)) {
         goto error;
     }
     if (blocksize == 0 || blocksize > size) {
@@ -2667,13 +4314,6 @@ size_t Sodaq_3Gbee::readFilePartial(const char* filename, uint8_t* buffer, size_
         goto error;
     }
 
-    // opening quote character
-    quote = timedRead();
-    if (quote != '"') {
-        debugPrintLn(DEBUG_STR_ERROR "Missing starting character (quote)!");
-        goto error;
-    }
-
     // actual file buffer, written directly to the provided result buffer
     len = readBytes(buffer, blocksize);
     if (len != blocksize) {
@@ -2698,14 +4338,23 @@ error:
 }
 
 bool Sodaq_3Gbee::writeFile(const char* filename, const uint8_t* buffer, size_t size)
+{
+    return writeFile(filename, NULL, 0, buffer, size);
+}
+
+bool Sodaq_3Gbee::writeFile(const char* filename, const uint8_t* head, size_t headSize,
+        const uint8_t* buffer, size_t size)
 {
     // TODO escape filename characters
     print("AT+UDWNFILE=\"");
     print(filename);
     print("\",");
-    println(size);
+    println(headSize + size);
 
     if (readResponse() == ResponsePrompt) {
+        for (size_t i = 0; i < headSize; i++) {
+            writeByte(head[i]);
+        }
         for (size_t i = 0; i < size; i++) {
             writeByte(buffer[i]);
         }
@@ -2763,7 +4412,10 @@ ResponseTypes Sodaq_3Gbee::_ulstfileSizeParser(ResponseTypes& response, const ch
         return ResponseError;
     }
 
-    if (sscanf(buffer, "+ULSTFILE: %lu", filesize) == 1) {
+    // uint32_t is not an unsigned long on every platform
+    unsigned long value;
+    if (sscanf(buffer, "+ULSTFILE: %lu", &value) == 1) {
+        *filesize = value;
         return ResponseEmpty;
     }
 
@@ -2778,6 +4430,38 @@ bool Sodaq_3Gbee::getRemainingFreeSpace(uint32_t & size)
     return readResponse<uint32_t, uint8_t>(_ulstfileSizeParser, &size, NULL) == ResponseOK;
 }
 
+uint32_t Sodaq_3Gbee::readFileChunks(const char* filename, uint8_t* buffer, size_t size,
+        FileChunkCallbackPtr callback, void* parameter, uint32_t offset)
+{
+    if (!buffer || size == 0 || !callback) {
+        return 0;
+    }
+
+    // The size is needed to know where to stop, AT+URDBLOCK fails beyond the end
+    uint32_t filesize;
+    if (!getFileSize(filename, filesize)) {
+        return 0;
+    }
+
+    uint32_t total = 0;
+    while (offset < filesize) {
+        size_t chunk = (filesize - offset < size) ? filesize - offset : size;
+        size_t len = readFilePartial(filename, buffer, chunk, offset);
+        if (len == 0) {
+            break;
+        }
+
+        total += len;
+        if (!callback(buffer, len, offset, parameter)) {
+            break;
+        }
+        offset += len;
+        sodaq_wdt_reset();
+    }
+
+    return total;
+}
+
 bool Sodaq_3Gbee::getFileSize(const char* filename, uint32_t & size)
 {
     print("AT+ULSTFILE=2,\"");
@@ -2877,3 +4561,176 @@ bool Sodaq_3GbeeOnOff::isOn()
     // No status pin. Let's assume it is on.
     return true;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////    MODEM FILE             /////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+Sodaq_3GbeeModemFile::Sodaq_3GbeeModemFile(uint8_t* buffer, size_t size, Sodaq_3Gbee& modem) :
+    _modem(modem)
+{
+    _buffer = buffer;
+    _bufferSize = size;
+    _bufferCount = 0;
+    _bufferStart = 0;
+    _filename = NULL;
+    _fileSize = 0;
+    _position = 0;
+}
+
+bool Sodaq_3GbeeModemFile::open(const char* filename)
+{
+    _filename = NULL;
+    _bufferCount = 0;
+    _bufferStart = 0;
+    _position = 0;
+
+    if (!_modem.getFileSize(filename, _fileSize)) {
+        return false;
+    }
+
+    _filename = filename;
+    return true;
+}
+
+bool Sodaq_3GbeeModemFile::seek(uint32_t position)
+{
+    if (!_filename || position > _fileSize) {
+        return false;
+    }
+
+    _position = position;
+    return true;
+}
+
+size_t Sodaq_3GbeeModemFile::read(uint8_t* buffer, size_t size)
+{
+    if (!_filename) {
+        return 0;
+    }
+
+    size_t total = 0;
+    while (total < size && _position < _fileSize) {
+        size_t count = size - total;
+        if (_fileSize - _position < count) {
+            count = _fileSize - _position;
+        }
+
+        if (_position >= _bufferStart && _position < _bufferStart + _bufferCount) {
+            // From the buffer
+            size_t offset = _position - _bufferStart;
+            if (_bufferCount - offset < count) {
+                count = _bufferCount - offset;
+            }
+            memcpy(&buffer[total], &_buffer[offset], count);
+        } else if (count >= _bufferSize || !_buffer) {
+            // Too large to be worth buffering
+            count = _modem.readFilePartial(_filename, &buffer[total], count, _position);
+        } else {
+            if (!fillBuffer()) {
+                break;
+            }
+            continue;
+        }
+
+        if (count == 0) {
+            break;
+        }
+        total += count;
+        _position += count;
+    }
+
+    return total;
+}
+
+int Sodaq_3GbeeModemFile::read()
+{
+    int c = peek();
+    if (c >= 0) {
+        _position++;
+    }
+
+    return c;
+}
+
+int Sodaq_3GbeeModemFile::peek()
+{
+    if (!_filename || _position >= _fileSize) {
+        return -1;
+    }
+
+    if ((_position < _bufferStart || _position >= _bufferStart + _bufferCount) && !fillBuffer()) {
+        return -1;
+    }
+
+    return _buffer[_position - _bufferStart];
+}
+
+// Reads a buffer full from the current position.
+bool Sodaq_3GbeeModemFile::fillBuffer()
+{
+    if (!_filename || !_buffer || _bufferSize == 0 || _position >= _fileSize) {
+        return false;
+    }
+
+    size_t chunk = (_fileSize - _position < _bufferSize) ? _fileSize - _position : _bufferSize;
+    _bufferStart = _position;
+    _bufferCount = _modem.readFilePartial(_filename, _buffer, chunk, _position);
+
+    return _bufferCount > 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////    FILE STREAM            /////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+Sodaq_3GbeeFileStream::Sodaq_3GbeeFileStream(uint8_t* buffer, size_t size, Sodaq_3Gbee& modem) :
+    _modem(modem),
+    _file(buffer, size, modem)
+{
+}
+
+bool Sodaq_3GbeeFileStream::begin(const char* filename, uint32_t offset)
+{
+    if (!_file.open(filename)) {
+        return false;
+    }
+
+    if (!_file.seek(offset)) {
+        _file.close();
+        return false;
+    }
+
+    return true;
+}
+
+bool Sodaq_3GbeeFileStream::beginHttpResponse()
+{
+    uint32_t bodyOffset = _modem.httpGetBodyOffset();
+    if (bodyOffset == 0) {
+        return false;
+    }
+
+    return begin(HTTP_RECEIVE_FILENAME, bodyOffset);
+}
+
+int Sodaq_3GbeeFileStream::available()
+{
+    if (!_file.isOpen()) {
+        return 0;
+    }
+
+    // An int is only 16 bits on AVR, while a response file can be larger
+    uint32_t remaining = _file.size() - _file.position();
+    return (remaining > INT_MAX) ? INT_MAX : static_cast<int>(remaining);
+}
+
+int Sodaq_3GbeeFileStream::read()
+{
+    return _file.read();
+}
+
+int Sodaq_3GbeeFileStream::peek()
+{
+    return _file.peek();
+}
@@ -10,6 +10,25 @@
 
 #define SOCKET_COUNT 7
 
+// How long (ms) socketReceive() waits for data by default
+#define DEFAULT_SOCKET_RECEIVE_TIMEOUT 10000
+
+// The number of entries in the URC handler table (built-in and user registered)
+#define URC_HANDLER_COUNT 14
+
+// The number of hosts cached by getHostIP(), and the longest host name that is cached
+#define DNS_CACHE_SIZE 4
+#define DNS_CACHE_HOST_SIZE 48
+
+// How long (ms) a resolved host, and a host that failed to resolve, is cached.
+// AT+UDNSRN does not tell the TTL of the DNS record.
+#define DEFAULT_DNS_CACHE_TTL 3600000UL
+#define DEFAULT_DNS_CACHE_FAILURE_TTL 60000UL
+
+// The number of operators kept by surveyOperators(), and the number of signal quality samples per operator
+#define OPERATOR_SURVEY_SIZE 4
+#define DEFAULT_OPERATOR_SURVEY_SAMPLES 3
+
 enum TriBoolStates
 {
     TriBoolFalse,
@@ -19,6 +38,91 @@ enum TriBoolStates
 
 typedef TriBoolStates tribool_t;
 
+// Callback for a chunk of a file on the modem, see readFileChunks().
+// The offset is the position of the chunk in the file.
+// Returns true to continue with the next chunk, false to stop.
+typedef bool (*FileChunkCallbackPtr)(const uint8_t* buffer, size_t size, uint32_t offset, void* parameter);
+
+// Producer of data to send, see ftpSend().
+// Fills the buffer with the next part of the data.
+// Returns the number of bytes written to the buffer, 0 at the end of the data.
+typedef size_t (*DataProducerPtr)(uint8_t* buffer, size_t size, void* parameter);
+
+// Callback for the progress of a transfer, see ftpReceive().
+typedef void (*ProgressCallbackPtr)(uint32_t done, uint32_t total, void* parameter);
+
+// Callback for a socket of which all output is acknowledged, see watchSocketOutput().
+typedef void (*SocketDrainedCallbackPtr)(uint8_t socket, void* parameter);
+
+// The state of a socket, see getSocketInfo().
+enum SocketStates {
+    SocketFree = 0,
+    SocketCreated,
+    SocketConnected,
+};
+
+// An entry of the socket table.
+struct SocketInfo_t {
+    SocketStates state;
+    Protocols protocol;
+    IP_t remoteIP;
+    uint16_t remotePort;
+    uint16_t pendingBytes;      // as reported by +UUSORD
+    bool closed;                // set when +UUSOCL is seen
+    uint32_t bytesSent;
+    uint32_t bytesReceived;
+    uint32_t unackedBytes;      // the last sample of AT+USOCTL=<socket>,11
+    SocketDrainedCallbackPtr drainedCallback;   // see watchSocketOutput()
+    void* drainedParameter;
+};
+
+// The network registration as reported by the +CREG and +CGREG URC's, see getNetworkRegistrationInfo().
+struct NetworkRegistrationInfo_t {
+    NetworkRegistrationStatuses status;         // circuit switched (+CREG)
+    NetworkRegistrationStatuses gprsStatus;     // packet switched (+CGREG)
+    NetworkTechnologies technology;             // UnknownNetworkTechnology if not reported
+    uint16_t lac;                               // location area code, 0 if not reported
+    uint32_t cellId;                            // 0 if not reported
+    uint32_t changedAt;                         // millis() of the last change of status
+};
+
+// A candidate operator of surveyOperators(), see getOperatorSurveyEntry().
+struct OperatorSurveyEntry_t {
+    char longName[24];                  // can be truncated
+    char number[8];                     // MCC and MNC
+    bool registered;                    // false if the modem did not register to it
+    int8_t rssi;                        // the average of the samples (dBm), 0 if unknown
+    NetworkTechnologies technology;
+    uint32_t surveyedAt;                // millis() of the survey
+};
+
+// An entry of the DNS cache, see getHostIP().
+struct DnsCacheEntry_t {
+    char host[DNS_CACHE_HOST_SIZE + 1];     // empty if the entry is free
+    IP_t ip;                                // NO_IP_ADDRESS if the host failed to resolve
+    uint32_t resolvedAt;
+    uint32_t lastUsed;                      // for replacing the least recently used entry
+};
+
+// The header of an HTTP response, see httpGetResponseInfo().
+struct HttpResponseInfo_t {
+    uint16_t statusCode;
+    int32_t contentLength;      // -1 if there is no Content-Length
+    char contentType[32];       // empty if there is no Content-Type, can be truncated
+    uint32_t bodyOffset;        // the size of the header
+    uint32_t fileSize;
+};
+
+// The content type of the body of an HTTP POST, as numbered by AT+UHTTPC.
+enum HttpContentTypes {
+    HttpContentFormUrlEncoded = 0,  // application/x-www-form-urlencoded
+    HttpContentTextPlain = 1,
+    HttpContentOctetStream = 2,
+    HttpContentMultipartFormData = 3,
+    HttpContentJson = 4,
+    HttpContentXml = 5
+};
+
 // Packet Switch Data (PSD) authorization type.
 enum PSDAuthType_e {
     PAT_TryAll = -1,                // This is not a UBlox number. Just our own.
@@ -28,9 +132,22 @@ enum PSDAuthType_e {
     PAT_AutoSelect = 3
 };
 
+// Callbacks that keep the PSD authentication type that works for an APN, see setPSDAuthStorage().
+// The load callback returns PAT_TryAll if nothing is stored for the APN.
+typedef PSDAuthType_e (*PSDAuthLoadCallbackPtr)(const char* apn, void* parameter);
+typedef void (*PSDAuthSaveCallbackPtr)(const char* apn, PSDAuthType_e authType, void* parameter);
+
 typedef ResponseTypes (*CallbackMethodPtr)(ResponseTypes& response, const char* buffer, size_t size,
         void* parameter, void* parameter2);
 
+// Handler for an unsolicited result code (URC), see setUrcHandler().
+// The buffer points to the parameters, that is the text following the prefix.
+// Returns true if the line was handled, false to pass it on as a regular response line.
+typedef bool (*UrcHandlerPtr)(const char* buffer, size_t size, void* parameter);
+
+// Callback for the completion of an asynchronous command (see sendCommandAsync()).
+typedef void (*AsyncCommandCallbackPtr)(ResponseTypes response, void* parameter);
+
 class Sodaq_3Gbee: public Sodaq_GSM_Modem, public Sodaq_MQTT_Interface {
 public:
     Sodaq_3Gbee();
@@ -48,12 +165,25 @@ public:
     void init_wdt(Stream& stream, int8_t onoffPin);
 
     // Set authentication of PSD profile (via AT+UPSD=<profile>,6,<num>)
+    // With PAT_TryAll, connect() tries the type that worked the previous time first, and the
+    // others only if that fails. See setPSDAuthStorage() for where that type is kept.
     void setPSDAuth(PSDAuthType_e authType) { _psdAuthType = authType; }
     PSDAuthType_e numToPSDAuthType(int8_t i);
 
+    // Keeps the PSD authentication type that works for the APN with the given callbacks,
+    // e.g. in the NVM of the MCU. By default it is kept in a small file on the modem.
+    void setPSDAuthStorage(PSDAuthLoadCallbackPtr load, PSDAuthSaveCallbackPtr save, void* parameter = NULL);
+
     // Turns on and initializes the modem, then connects to the network and activates the data connection.
+    // See setWarmConnect() for reusing a data connection that is still active.
     bool connect();
 
+    // Lets connect() return right away when the modem is still on, registered and its data
+    // connection is still active, e.g. since the previous wake cycle. This is checked with AT,
+    // AT+CREG? and AT+UPSND.
+    // Otherwise connect() starts from scratch, like it does by default.
+    void setWarmConnect(bool x = true) { _warmConnect = x; }
+
     // Turns on and initializes the modem.
     bool connectSimple();
 
@@ -63,12 +193,71 @@ public:
     // Returns true if the modem is connected to the network and has an activated data connection.
     bool isConnected();
 
+    // ==== Asynchronous commands
+
+    // Sends the given command and returns immediately, the response is handled by poll().
+    // The (optional) parser method is called for each line of the response, just like
+    // with the blocking methods, and the (optional) completion callback is called with
+    // the final response (ResponseOK, ResponseError, ResponseTimeout, ...).
+    // Only one asynchronous command can be pending. The blocking methods wait for it
+    // to complete before they send their command.
+    // Returns false if another asynchronous command is still pending.
+    bool sendCommandAsync(const char* command, uint32_t timeout = DEFAULT_READ_MS,
+            CallbackMethodPtr parserMethod = NULL, void* callbackParameter = NULL, void* callbackParameter2 = NULL,
+            AsyncCommandCallbackPtr completionCallback = NULL, void* completionParameter = NULL);
+
+    template<typename T1, typename T2>
+    bool sendCommandAsync(const char* command, uint32_t timeout,
+            ResponseTypes(*parserMethod)(ResponseTypes& response, const char* parseBuffer, size_t size, T1* parameter, T2* parameter2),
+            T1* callbackParameter, T2* callbackParameter2,
+            AsyncCommandCallbackPtr completionCallback = NULL, void* completionParameter = NULL)
+    {
+        return sendCommandAsync(command, timeout, (CallbackMethodPtr)parserMethod,
+                (void*)callbackParameter, (void*)callbackParameter2, completionCallback, completionParameter);
+    };
+
+    // Handles whatever the modem has sent so far, without blocking. URC's are always
+    // processed, so this can also be called when no command is pending.
+    // Call it regularly, for example from loop().
+    // Returns the final response of the asynchronous command when it completes during
+    // this call, ResponseNotFound otherwise.
+    ResponseTypes poll();
+
+    // Handles the input and the asynchronous command, like poll() but without starting
+    // any commands of its own. This is what the library itself uses, e.g. the HTTP client.
+    ResponseTypes pollInput();
+
+    // Returns true if an asynchronous command is waiting for its response.
+    bool isAsyncCommandPending() const { return _asyncPending; }
+
+    // Returns the final response of the last asynchronous command,
+    // or ResponseNotFound while it is still pending.
+    ResponseTypes getAsyncCommandResult() const { return _asyncPending ? ResponseNotFound : _asyncResult; }
+
+    // ==== URC's
+
+    // Registers a handler for the URC with the given prefix, for example "+CMTI:".
+    // The prefix must be a static string. Registering the same prefix again replaces
+    // the handler, a NULL handler removes it.
+    // Returns false if the prefix is invalid, the table is full or it is a built-in URC.
+    bool setUrcHandler(const char* prefix, UrcHandlerPtr handler, void* parameter = NULL);
+
     // Returns the current status of the network.
     NetworkRegistrationStatuses getNetworkStatus();
 
     // Returns the network technology the modem is currently registered to.
     NetworkTechnologies getNetworkTechnology();
 
+    // Returns the registration state that is kept up to date by the +CREG and +CGREG URC's.
+    // They are enabled when the modem is initialized, see connect(). Call poll() to handle them.
+    const NetworkRegistrationInfo_t* getNetworkRegistrationInfo() const { return &_networkInfo; }
+
+    // Waits until the modem is registered (home or roaming) to the network, either circuit
+    // switched or packet switched only. The wait is driven by the +CREG and +CGREG URC's,
+    // the status is queried only once.
+    // Returns true if the modem is registered.
+    bool waitForRegistration(uint32_t timeout);
+
     // Gets the Received Signal Strength Indication in dBm and Bit Error Rate.
     // Returns true if successful.
     bool getRSSIAndBER(int8_t* rssi, uint8_t* ber);
@@ -80,8 +269,25 @@ public:
     bool getOperatorName(char* buffer, size_t size);
 
     // Select the Best Operator.
+    // The operators are ranked by surveyOperators(), unless the ranking is younger than
+    // maxSurveyAge (ms). Only the best one is connected to. A single available operator
+    // is connected to without a survey.
     // Returns true if successful.
-    bool selectBestOperator(Stream & verbose_stream);
+    bool selectBestOperator(Stream & verbose_stream) { return selectBestOperator(verbose_stream, 0); }
+    bool selectBestOperator(Stream & verbose_stream, uint32_t maxSurveyAge);
+
+    // Registers to each available operator in turn and samples its signal quality, without
+    // activating the data connection. The operators are ranked by signal strength, the ones
+    // the modem could not register to last. Only the best OPERATOR_SURVEY_SIZE are kept.
+    // The last operator surveyed stays selected.
+    // Returns the number of operators the modem registered to.
+    uint8_t surveyOperators(Stream & verbose_stream, uint8_t samples = DEFAULT_OPERATOR_SURVEY_SAMPLES);
+
+    // Returns the number of operators of the last surveyOperators()
+    uint8_t getOperatorSurveyCount() const { return _operatorSurveyCount; }
+
+    // Returns the operator at the given rank of the last surveyOperators(), or NULL.
+    const OperatorSurveyEntry_t* getOperatorSurveyEntry(uint8_t rank) const;
 
     // Select the an Operator (and measure RSSI).
     // Returns true if successful.
@@ -113,8 +319,17 @@ public:
     IP_t getLocalIP();
 
     // Returns the IP of the given host (nslookup).
+    // The result is cached, also when the host does not resolve, see setDnsCacheTtl().
     IP_t getHostIP(const char* host);
 
+    // Sets how long (ms) a resolved host, and a host that failed to resolve, is cached.
+    // A failureTtl of 0 disables the caching of failures.
+    void setDnsCacheTtl(uint32_t ttl, uint32_t failureTtl = DEFAULT_DNS_CACHE_FAILURE_TTL);
+
+    // Sets the hosts that are resolved right after connect(), so that the first connection
+    // to them does not wait for the lookup. The array is not copied, it must stay valid.
+    void setPreresolveHosts(const char* const* hosts, uint8_t count);
+
     // Returns the sent and received counters
     bool getSessionCounters(uint32_t* sentCnt, uint32_t* recvCnt);
     //bool getTotalCounters(uint32_t* sentCnt, uint32_t* recvCnt);
@@ -130,6 +345,7 @@ public:
     bool connectSocket(uint8_t socket, const char* host, uint16_t port);
 
     // Sends the given buffer through the given socket.
+    // Buffers larger than the modem accepts in one write are sent in segments.
     // Returns true if successful.
     bool socketSend(uint8_t socket, const uint8_t* buffer, size_t size);
 
@@ -137,10 +353,44 @@ public:
     // Returns true if successful.
     bool socketSend(uint8_t socket, const char* str);
 
+    // Buffers the given data for the given socket, so that small writes are merged into
+    // a single AT+USOWR. The data is sent when the buffer is full, with socketFlush(), or
+    // before the socket is read or closed.
+    // Returns true if successful.
+    bool socketWrite(uint8_t socket, const uint8_t* buffer, size_t size);
+
+    // Sends the data buffered by socketWrite() for the given socket. Data that could
+    // not be sent stays buffered.
+    // Returns true if successful.
+    bool socketFlush(uint8_t socket);
+
+    // Drops the data buffered by socketWrite() for the given socket, e.g. after a failed
+    // socketFlush() when the data will be sent again.
+    void discardSocketWrites(uint8_t socket);
+
+    // Sets the size of the buffer used by socketWrite(), default 256 bytes.
+    // The buffer is allocated on first use.
+    // Returns false if the buffered data could not be sent, the size is not changed then.
+    bool setSocketWriteBufferSize(size_t size);
+
     // Reads data from the given socket into the given buffer.
     // Returns the number of bytes written to the buffer.
+    // NOTE: if the modem hasn't reported available data, it blocks for up to "timeout" ms waiting.
+    size_t socketReceive(uint8_t socket, uint8_t* buffer, size_t size)
+            { return socketReceive(socket, buffer, size, DEFAULT_SOCKET_RECEIVE_TIMEOUT); }
+    size_t socketReceive(uint8_t socket, uint8_t* buffer, size_t size, uint32_t timeout);
+
+    // Sends the given buffer as a datagram to the given remote, through the given UDP socket.
+    // The socket does not need to be connected, see connectSocket().
+    // Returns true if successful.
+    bool sendTo(uint8_t socket, IP_t ip, uint16_t port, const uint8_t* buffer, size_t size);
+    bool sendTo(uint8_t socket, const char* host, uint16_t port, const uint8_t* buffer, size_t size);
+
+    // Reads a datagram from the given UDP socket into the given buffer. The sender is
+    // returned in "remoteIP" and "remotePort" (both are optional).
+    // Returns the number of bytes written to the buffer.
     // NOTE: if the modem hasn't reported available data, it blocks for up to 10 seconds waiting.
-    size_t socketReceive(uint8_t socket, uint8_t* buffer, size_t size);
+    size_t receiveFrom(uint8_t socket, uint8_t* buffer, size_t size, IP_t* remoteIP = NULL, uint16_t* remotePort = NULL);
 
     // Returns the number of bytes pending in the read buffer of the given socket .
     size_t socketBytesPending(uint8_t socket);
@@ -155,9 +405,36 @@ public:
     // TODO Figure out what a good timeout value is. 60 seconds is very long.
     void waitForSocketClose(uint8_t socket, uint32_t timeout=60000);
 
+    // Creates a socket of the given protocol and connects it to the given host and port.
+    // Other open sockets are left alone, the network is only connected if there are none.
+    // Returns the socket or SOCKET_FAIL in case of error.
+    int openSocket(Protocols protocol, const char* host, uint16_t port);
+
+    // Returns the socket table entry of the given socket, or NULL if there is no such socket.
+    const SocketInfo_t* getSocketInfo(uint8_t socket) const;
+
+    // Returns the number of sockets that are in use.
+    uint8_t getOpenSocketCount() const;
+
+    // Returns the number of bytes sent on the given socket that are not acknowledged
+    // by the remote yet, or -1 in case of error. It does not wait for the output to drain.
+    int32_t getSocketUnackedBytes(uint8_t socket);
+
+    // Watches the unacknowledged output of the given socket without blocking. poll()
+    // samples it every now and then and calls the callback once, when all output is
+    // acknowledged. Only the application's calls of poll() sample, the waits inside the
+    // library don't. A NULL callback cancels the watch.
+    // The latest sample is in getSocketInfo()->unackedBytes.
+    void watchSocketOutput(uint8_t socket, SocketDrainedCallbackPtr callback, void* parameter = NULL);
+
     // Make sure output is acknowledged by the server when doing socketSend
     void setFlushEverySend(bool x = true) { _flushEverySend = x; }
 
+    // Exchange the socket data with the modem as raw bytes instead of hex strings.
+    // This halves the traffic on the serial line and allows reads of up to 1024 bytes.
+    // Must be called before connect(), the mode is set in the initial commands.
+    void setSocketBinaryMode(bool x = true) { _socketBinaryMode = x; }
+
     // ==== TCP
 
     // Open a TCP connection
@@ -168,6 +445,7 @@ public:
 
     // Close the TCP connection
     // This is merely a convenience wrapper which can use socket functions.
+    // The modem is only switched off if no other sockets are open.
     void closeTCP(bool switchOff=true);
 
     // Send data via TCP
@@ -194,13 +472,39 @@ public:
     uint32_t httpGet(const char* server, uint16_t port, const char* endpoint,
              char* buffer, size_t bufferSize);
 
+    // Sets the content type of the body of the next POST requests of httpRequest(),
+    // default text/plain.
+    void setHttpContentType(HttpContentTypes contentType) { _httpContentType = contentType; }
+
+    // Sends an HTTP POST with the contents of the given file on the modem as body.
+    // The response is handled as with httpRequest().
+    size_t httpPostFile(const char* server, uint16_t port, const char* endpoint,
+            const char* filename, HttpContentTypes contentType,
+            char* responseBuffer = NULL, size_t responseSize = 0);
+
     // Determine HTTP header size
     uint32_t httpGetHeaderSize(const char * filename);
 
+    // Parses the header of the HTTP response in the given file, in a single pass.
+    // Returns true if successful.
+    bool httpParseResponseHeader(const char* filename, HttpResponseInfo_t& info);
+
+    // Returns the header of the response of the previous HTTP Request, or NULL if
+    // the response has no valid header. It is parsed once per request.
+    const HttpResponseInfo_t* httpGetResponseInfo();
+
     // Return a partial result of the previous HTTP Request (GET or POST)
     // Offset 0 is the byte directly after the HTTP Response header
     size_t httpGetPartial(uint8_t* buffer, size_t size, uint32_t offset);
 
+    // Returns the offset of the body in the response of the previous HTTP Request,
+    // or 0 if the response has no valid header.
+    uint32_t httpGetBodyOffset();
+
+    // Walks the body of the previous HTTP Request in chunks, see readFileChunks().
+    // Returns the number of bytes handed to the callback.
+    uint32_t httpGetChunks(uint8_t* buffer, size_t size, FileChunkCallbackPtr callback, void* parameter = NULL);
+
     // ==== FTP
 
     // Opens an FTP connection.
@@ -210,8 +514,10 @@ public:
     bool closeFtpConnection();
 
     // Opens an FTP file for sending or receiving.
+    // The current directory is kept if the path is the same as that of the previous file.
     // filename should be limited to 256 characters (excl. null terminator)
-    // path should be limited to 512 characters (excl. null temrinator)
+    // path should be limited to 128 characters (excl. null terminator)
+    // Returns false if the directory could not be changed.
     bool openFtpFile(const char* filename, const char* path = NULL);
     
     // Sends the given "buffer" to the (already) open FTP file.
@@ -220,14 +526,37 @@ public:
     bool ftpSend(const char* buffer);
     bool ftpSend(const uint8_t* buffer, size_t size);
 
+    // Sends the data of the producer, see DataProducerPtr, or "length" bytes of the stream to
+    // the (already) open FTP file. The data is collected on the modem a buffer at a time, so it
+    // does not have to fit in RAM. Returns true if successful.
+    // NOTE: the file is not stored if the stream times out (see Stream::setTimeout()) before
+    // "length" bytes are read.
+    bool ftpSend(DataProducerPtr producer, void* parameter, uint8_t* buffer, size_t size);
+    bool ftpSend(Stream& stream, uint32_t length, uint8_t* buffer, size_t size);
+
+    // Sends the data of several ftpSendAppend() calls as a single file to the (already) open
+    // FTP file. The data is collected on the modem until ftpSendEnd().
+    bool ftpSendBegin();
+    bool ftpSendAppend(const uint8_t* buffer, size_t size);
+    bool ftpSendEnd();
+
     // Fills the given "buffer" from the (already) open FTP file.
     // Returns true if successful.
     // Fails immediatelly if there is no open FTP file.
     int ftpReceive(char* buffer, size_t size);
+
+    // Streams the (already) open FTP file, from the given offset, to the callback in chunks
+    // of the given buffer, see readFileChunks(). The progress callback is optional.
+    // The file is retrieved into the modem filesystem first. It is kept there until another
+    // FTP file is opened, so that a next call with an offset resumes without retrieving
+    // it again.
+    // Returns the number of bytes handed to the callback.
+    uint32_t ftpReceive(uint8_t* buffer, size_t size, FileChunkCallbackPtr callback, void* parameter = NULL,
+            uint32_t offset = 0, ProgressCallbackPtr progress = NULL);
     
     // Closes the open FTP file.
+    // The current directory is kept, for the next file in the same directory.
     // Returns true if successful.
-    // Fails immediatelly if there is no open FTP file.
     bool closeFtpFile();
     
     // ==== Sms
@@ -251,26 +580,53 @@ public:
     // MQTT (using this class as a transport)
     bool openMQTT(const char * server, uint16_t port = 1883);
     bool closeMQTT(bool switchOff=true);
+    // The packet is sent right away, unless setMQTTPacketBuffering() is set
     bool sendMQTTPacket(uint8_t * pckt, size_t len);
     size_t receiveMQTTPacket(uint8_t * pckt, size_t size, uint32_t timeout = 20000);
     size_t availableMQTTPacket();
     bool isAliveMQTT();
     void setMQTTClosedHandler(void (*handler)(void)) { setTCPClosedHandler(handler); }
 
+    // Lets sendMQTTPacket() buffer the packets, see socketWrite(), so that small packets
+    // share one AT+USOWR. They are sent by availableMQTTPacket() and receiveMQTTPacket().
+    // NOTE: sendMQTTPacket() can't report a failure then, the connection is closed instead.
+    void setMQTTPacketBuffering(bool x = true) { _mqttPacketBuffering = x; }
+
     size_t readFile(const char* filename, uint8_t* buffer, size_t size);
     size_t readFilePartial(const char* filename, uint8_t* buffer, size_t size, uint32_t offset);
+
+    // Walks the given file, starting at "offset", with one AT+URDBLOCK per chunk.
+    // Each chunk is read into the buffer, the size of the buffer is the chunk size,
+    // and handed to the callback. The file can be larger than the buffer.
+    // Returns the number of bytes handed to the callback.
+    uint32_t readFileChunks(const char* filename, uint8_t* buffer, size_t size,
+            FileChunkCallbackPtr callback, void* parameter = NULL, uint32_t offset = 0);
+    // Writes the buffer to the given file, or appends it if the file already exists.
     bool writeFile(const char* filename, const uint8_t* buffer, size_t size);
+    // Same, for a buffer in two parts, e.g. a record and its separator, in a single AT+UDWNFILE.
+    bool writeFile(const char* filename, const uint8_t* head, size_t headSize, const uint8_t* buffer, size_t size);
     bool deleteFile(const char* filename);
     bool listFiles();
     bool getRemainingFreeSpace(uint32_t & size);
     bool getFileSize(const char* filename, uint32_t & size);
 
-    void clearCachedHostIp() { _host_ip = NO_IP_ADDRESS; }
+    // Forgets all hosts cached by getHostIP()
+    void clearCachedHostIp();
+
+    // Forgets the server configured in HTTP profile 0, the next httpRequest()
+    // configures it from scratch.
+    void clearCachedHttpProfile() { _httpProfilePort = 0; }
 
     // Getters of diagnostic values
     uint32_t getTimeToSocketConnect() { return _timeToSocketConnect; }
     uint32_t getTimeToSocketClose() { return _timeToSocketClose; }
 
+    // The time (ms) between sending the most recent command and receiving its response
+    uint32_t getLastResponseTime() { return _lastResponseTime; }
+    // The average response time (ms) since the start, or since resetResponseTimes()
+    uint32_t getAverageResponseTime() { return _responseCount ? _responseTimeTotal / _responseCount : 0; }
+    void resetResponseTimes() { _responseTimeTotal = 0; _responseCount = 0; }
+
     // Selecting the best network
     bool deregisterNetwork(uint32_t timeout);
     bool getOperators(String & listOfOperators);
@@ -291,6 +647,11 @@ protected:
     ResponseTypes readResponse(char* buffer, size_t size,
             CallbackMethodPtr parserMethod, void* callbackParameter, void* callbackParameter2 = NULL,
             size_t* outSize = NULL, uint32_t timeout = DEFAULT_READ_MS);
+
+    // Handles a single line of a response, used by readResponse() and poll().
+    // Returns ResponseNotFound if more lines are needed.
+    ResponseTypes handleResponseLine(char* buffer, size_t count, CallbackMethodPtr& parserMethod,
+            void* callbackParameter, void* callbackParameter2, ResponseTypes& response);
     
     ResponseTypes readResponse(size_t* outSize = NULL, uint32_t timeout = DEFAULT_READ_MS)
     {
@@ -316,26 +677,154 @@ protected:
 
 private:
     PSDAuthType_e _psdAuthType;
+    PSDAuthLoadCallbackPtr _psdAuthLoadCallback;
+    PSDAuthSaveCallbackPtr _psdAuthSaveCallback;
+    void* _psdAuthStorageParameter;
 
-    uint16_t _socketPendingBytes[SOCKET_COUNT]; // TODO add getter
+    // Returns the PSD authentication type that worked for the APN, or PAT_TryAll if unknown
+    PSDAuthType_e loadPSDAuthType();
+    void savePSDAuthType(PSDAuthType_e authType);
+
+    SocketInfo_t _sockets[SOCKET_COUNT];
     tribool_t _httpRequestSuccessBit[HttpRequestTypesMAX];
-    bool _socketClosedBit[SOCKET_COUNT];
     uint8_t ftpCommandURC[2];
     char ftpFilename[256 + 1]; // always null terminated
-    uint8_t ftpDirectoryChangeCounter; // counts how many nested directories were changed, to revert on close
+    char ftpPath[128 + 1]; // the current FTP directory, relative to the one after login, e.g. "a/b"
+    bool ftpReceiveCached; // the open FTP file is in FTP_RECEIVE_FILENAME, see ftpReceive()
     int _openTCPsocket;
 
-    uint32_t _httpGetHeaderSize;
+    // The header of the last HTTP response, _httpResponseParsed is undefined until parsed
+    HttpResponseInfo_t _httpResponseInfo;
+    tribool_t _httpResponseParsed;
+
+    // The server configured in HTTP profile 0, valid if the port is not 0 and
+    // the modem was not switched off or on since (see _powerCycleCount)
+    char* _httpProfileHost;
+    uint16_t _httpProfilePort;
+    uint16_t _httpProfilePowerCycle;
+
+    // Configures HTTP profile 0 for the given server, unless it already is.
+    bool setHttpProfile(const char* server, uint16_t port);
+
+    // The content type of POST requests of httpRequest()
+    HttpContentTypes _httpContentType;
+
+    // Sends an HTTP request with the given file (on the modem) as body, if any.
+    size_t sendHttpRequest(const char* server, uint16_t port, const char* endpoint,
+            HttpRequestTypes requestType, const char* sendFilename, HttpContentTypes contentType,
+            char* responseBuffer, size_t responseSize);
 
     uint32_t _timeToSocketConnect;
     uint32_t _timeToSocketClose;
 
+    uint32_t _lastResponseTime;
+    uint32_t _responseTimeTotal;
+    uint32_t _responseCount;
+
+    void recordResponseTime();
+
+    // Marks all sockets free, e.g. after the data connection is gone
+    void resetSockets();
+
+    // Connects to the network, unless open sockets are already using the connection.
+    bool connectSharingSockets();
+
     bool _foundUUPSDD;
 
-    IP_t _host_ip;
-    char _host_name[20];        // an arbitrary size, see getHostIP() for details
+    // The registration state, updated by the +CREG and +CGREG URC's
+    NetworkRegistrationInfo_t _networkInfo;
+    bool _registrationUrcEnabled;
+
+    // Forgets the registration state, e.g. before the URC's are (re)enabled
+    void resetNetworkInfo();
+
+    // The DNS cache, see getHostIP()
+    DnsCacheEntry_t _dnsCache[DNS_CACHE_SIZE];
+    uint32_t _dnsCacheTtl;
+    uint32_t _dnsCacheFailureTtl;
+    uint32_t _dnsCacheUseCount;
+    const char* const* _preresolveHosts;
+    uint8_t _preresolveHostCount;
+
+    // Returns the cache entry of the given host, or NULL if it is not cached (anymore).
+    DnsCacheEntry_t* findDnsCacheEntry(const char* host);
+    void storeDnsCacheEntry(const char* host, IP_t ip);
+
+    // Resolves the hosts of setPreresolveHosts(), after failures are forgotten.
+    void preresolveHosts();
+
+    // The ranking of surveyOperators()
+    OperatorSurveyEntry_t _operatorSurvey[OPERATOR_SURVEY_SIZE];
+    uint8_t _operatorSurveyCount;
+
+    // Gets the list of operators (AT+COPS=?), with a few retries.
+    bool getOperatorList(String& listOfOperators, Stream& verbose_stream);
+
+    // Surveys the operators of the given list, see surveyOperators().
+    uint8_t surveyOperatorList(const String& listOfOperators, Stream& verbose_stream, uint8_t samples);
+
+    // Samples the signal quality and the technology of the current operator into the survey entry.
+    void sampleOperator(OperatorSurveyEntry_t& entry, uint8_t samples);
+
+    // Sends the packets buffered by sendMQTTPacket(), the connection is closed if that fails.
+    bool flushMQTTPackets();
 
     bool _flushEverySend;
+    bool _socketBinaryMode;
+    bool _warmConnect;
+    bool _mqttPacketBuffering;
+
+    // The socketWrite() buffer, it holds the data of one socket at a time
+    uint8_t* _writeBuffer;
+    size_t _writeBufferSize;
+    size_t _writeBufferCount;
+    uint8_t _writeBufferSocket;
+
+    // The socket of which the output is sampled, see watchSocketOutput()
+    uint8_t _outputSampleSocket;
+    uint16_t _outputSampleValue;
+    uint32_t _lastOutputSample;
+
+    // Starts an asynchronous AT+USOCTL=<socket>,11 for the next watched socket
+    void sampleSocketOutput();
+    static void _socketOutputSampled(ResponseTypes response, void* parameter);
+
+    // Waits for the asynchronous command to complete
+    void beforeCommand();
+
+    // Handles the URC's that have arrived, for the loops that wait for one.
+    // Idles a moment when the UART is empty, instead of spinning.
+    void pollIdle();
+
+    // Sends a single AT+USOWR, the size must not exceed what the modem accepts
+    bool socketSendSegment(uint8_t socket, const uint8_t* buffer, size_t size);
+
+    // The asynchronous command (see sendCommandAsync() and poll())
+    bool _asyncPending;
+    CallbackMethodPtr _asyncParserMethod;
+    void* _asyncCallbackParameter;
+    void* _asyncCallbackParameter2;
+    AsyncCommandCallbackPtr _asyncCompletionCallback;
+    void* _asyncCompletionParameter;
+    uint32_t _asyncStart;
+    uint32_t _asyncTimeout;
+    ResponseTypes _asyncResponse;
+    ResponseTypes _asyncResult;
+
+    void finishAsyncCommand(ResponseTypes result);
+
+    // The URC handler table (see setUrcHandler() and dispatchUrc())
+    struct UrcHandler_t {
+        const char* prefix;
+        size_t prefixLen;
+        UrcHandlerPtr handler;
+        void* parameter;
+    };
+    UrcHandler_t _urcHandlers[URC_HANDLER_COUNT];
+    size_t _urcHandlerCount;
+    size_t _urcBuiltinCount;
+
+    bool dispatchUrc(const char* buffer, size_t size);
 
     bool tryAuthAndActivate(PSDAuthType_e authType);
 
@@ -348,19 +837,50 @@ private:
     bool doInitialCommands();
     bool doSIMcheck();
     bool enableAutoRegistration(uint32_t timeout = 4L * 60 * 1000);
+
+    // Returns the current status of the packet switched registration (AT+CGREG?).
+    NetworkRegistrationStatuses getGprsNetworkStatus();
     bool waitForSignalQuality(uint32_t timeout = 60L * 1000);
 
     bool setBinaryMode();
     bool setHexMode();
 
+    // Reads the header of a response which is followed by a quoted block of data,
+    // up to and including the opening quote. Returns the size of the data in "size".
+    bool readDataHeader(const char* literal, uint32_t& size, uint32_t timeout = 1000);
+
+    // Reads the start of a data response up to the first quote, e.g. +USORF: 0,
+    // URC's before it are dispatched. The view is checked for the given literal.
+    bool readDataPrefix(const char* literal, char*& header, size_t& len, uint32_t timeout = 1000);
+
+    // Reads a socket data response, e.g. +USORD: 0,12,"<data>", straight into the
+    // given buffer, including the closing quote and the final OK. Hex data is
+    // decoded on the fly, unless the socket binary mode is set.
+    // Returns the number of bytes read, or -1 on error.
+    int readSocketData(const char* literal, uint8_t* buffer, size_t size);
+
+    // Reads "count" bytes of socket data, see readSocketData(), after the header has been read.
+    int readSocketPayload(uint8_t* buffer, size_t size, size_t count);
+
+    // Blocks for up to "timeout" ms while there are no data available on the given socket.
+    // Returns the number of bytes that can be read in one go into a buffer of the given size.
+    size_t waitForSocketData(uint8_t socket, size_t size, uint32_t timeout = DEFAULT_SOCKET_RECEIVE_TIMEOUT);
+
+    // Returns the IP of the given host, which can also be given in dotted notation.
+    IP_t resolveHost(const char* host);
+
     // Wait until no more un-acknowledged data in output
     // Return true if no more data, false if error, or timeout
     bool waitForSocketOutput(uint8_t socket, uint32_t timeout=10000);
 
     // returns true if URC returns 1, false in case URC returns 0 or in case of timeout
     bool waitForFtpCommandResult(uint8_t ftpCommandIndex, uint32_t timeout=10000);
+    bool storeFtpTmpFile();
     bool changeFtpDirectory(const char* directory);
-    void resetFtpDirectoryIfNeeded();
+    bool setFtpPath(const char* path);
+
+    // Hands a chunk of the FTP file to the callback of ftpReceive() and reports the progress.
+    static bool _ftpReceiveChunk(const uint8_t* buffer, size_t size, uint32_t offset, void* parameter);
 
     bool waitForDeactivatedNetwork(uint32_t timeout);
 
@@ -369,13 +889,22 @@ private:
     static int _httpRequestTypeToModemIndex(HttpRequestTypes requestType);
     static int _httpModemIndexToRequestType(uint8_t modemIndex);
 
+    // ==== URC Handlers
+    static bool _uusordUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _uusoclUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _uuhttpcrUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _uuftpcrUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _uupsddUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _cregUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _cgregUrcHandler(const char* buffer, size_t size, void* parameter);
+    static bool _ignoreUrcHandler(const char* buffer, size_t size, void* parameter);
+
     // ==== Parser Methods
     static ResponseTypes _cpinParser(ResponseTypes& response, const char* buffer, size_t size, SimStatuses* simStatusResult, uint8_t* dummy);
     static ResponseTypes _udnsrnParser(ResponseTypes& response, const char* buffer, size_t size, IP_t* ipResult, uint8_t* dummy);
     static ResponseTypes _upsndParser(ResponseTypes& response, const char* buffer, size_t size, IP_t* ipResult, uint8_t* dummy);
     static ResponseTypes _upsndParser(ResponseTypes& response, const char* buffer, size_t size, uint8_t* thirdParam, uint8_t* dummy);
     static ResponseTypes _usocrParser(ResponseTypes& response, const char* buffer, size_t size, uint8_t* socket, uint8_t* dummy);
-    static ResponseTypes _usordParser(ResponseTypes& response, const char* buffer, size_t size, char* resultBuffer, uint8_t* dummy);
     static ResponseTypes _usoctlParser(ResponseTypes& response, const char* buffer, size_t size, uint16_t* result, uint8_t* dummy);
     static ResponseTypes _copsParser(ResponseTypes& response, const char* buffer, size_t size, char* operatorNameBuffer, size_t* operatorNameBufferSize);
     static ResponseTypes _copsParser(ResponseTypes& response, const char* buffer, size_t size, int* networkTechnology, uint8_t* dummy);
@@ -397,4 +926,80 @@ private:
 
 extern Sodaq_3Gbee sodaq_3gbee;
 
+// A handle of a file on the modem, for reading at any position.
+// The buffer, given by the caller, is filled with one AT+URDBLOCK ahead of
+// the position, so that small reads are served from RAM. Reads that are as
+// large as the buffer go straight to the caller. The size of the file is
+// queried once, when it is opened.
+class Sodaq_3GbeeModemFile
+{
+public:
+    Sodaq_3GbeeModemFile(uint8_t* buffer, size_t size, Sodaq_3Gbee& modem = sodaq_3gbee);
+
+    // Opens the given file at position 0.
+    // The filename is not copied, it must stay valid while the file is open.
+    // Returns false if the file does not exist.
+    bool open(const char* filename);
+    void close() { _filename = NULL; }
+    bool isOpen() const { return _filename != NULL; }
+
+    // Returns the size of the file, as it was when it was opened
+    uint32_t size() const { return _fileSize; }
+    uint32_t position() const { return _position; }
+
+    // Moves to the given position, the buffered data is kept.
+    // Returns false if the position is beyond the end of the file.
+    bool seek(uint32_t position);
+
+    // Reads up to size bytes at the current position.
+    // Returns the number of bytes read, 0 at the end of the file.
+    size_t read(uint8_t* buffer, size_t size);
+
+    // Returns the byte at the current position, -1 at the end of the file.
+    int read();
+    int peek();
+
+private:
+    bool fillBuffer();
+
+    Sodaq_3Gbee& _modem;
+    uint8_t* _buffer;
+    size_t _bufferSize;
+    size_t _bufferCount;
+    uint32_t _bufferStart;      // the position of the first buffered byte
+    const char* _filename;
+    uint32_t _fileSize;
+    uint32_t _position;
+};
+
+// Reads a file on the modem as a Stream, one AT+URDBLOCK per buffer full.
+// Only the buffer, given by the caller, is used to hold the data, so the
+// file can be much larger than the available RAM.
+class Sodaq_3GbeeFileStream : public Stream
+{
+public:
+    Sodaq_3GbeeFileStream(uint8_t* buffer, size_t size, Sodaq_3Gbee& modem = sodaq_3gbee);
+
+    // Starts reading the given file at the given offset.
+    // The filename is not copied, it must stay valid while reading.
+    // Returns false if the file does not exist.
+    bool begin(const char* filename, uint32_t offset = 0);
+
+    // Starts reading the body of the response of the previous HTTP Request.
+    // Returns false if there is no valid response.
+    bool beginHttpResponse();
+
+    // Returns the number of bytes that are left in the file
+    int available();
+    int read();
+    int peek();
+
+    // The file is read-only
+    size_t write(uint8_t value) { return 0; }
+
+private:
+    Sodaq_3Gbee& _modem;
+    Sodaq_3GbeeModemFile _file;
+};
+
 #endif
@@ -0,0 +1,149 @@
+#include <Arduino.h>
+
+#include "Sodaq_3GbeeHttpBatch.h"
+
+Sodaq_3GbeeHttpBatch::Sodaq_3GbeeHttpBatch(uint8_t* buffer, size_t size, Sodaq_3Gbee& modem) :
+    _modem(modem)
+{
+    _buffer = buffer;
+    _bufferSize = size;
+    _bufferCount = 0;
+    _server = NULL;
+    _port = 80;
+    _endpoint = NULL;
+    _contentType = HttpContentOctetStream;
+    _format = HttpBatchNewline;
+    _maxSize = DEFAULT_HTTP_BATCH_MAX_SIZE;
+    _maxAge = 0;
+    _fileSize = 0;
+    _recordCount = 0;
+    _firstRecordTime = 0;
+    _lastStatusCode = 0;
+}
+
+void Sodaq_3GbeeHttpBatch::begin(const char* server, uint16_t port, const char* endpoint,
+        HttpContentTypes contentType, HttpBatchFormats format, uint32_t maxSize, uint32_t maxAge)
+{
+    _server = server;
+    _port = port;
+    _endpoint = endpoint;
+    _contentType = contentType;
+    _format = format;
+    _maxSize = maxSize;
+    _maxAge = maxAge;
+    _lastStatusCode = 0;
+
+    clear();
+}
+
+bool Sodaq_3GbeeHttpBatch::add(const uint8_t* record, size_t size)
+{
+    if (!_server) {
+        return false;
+    }
+
+    size_t total = size + ((_format == HttpBatchLengthPrefixed) ? 2 : 1);
+    if (total > _bufferSize || total > _maxSize
+            || (_format == HttpBatchLengthPrefixed && size > 0xFFFF)) {
+        return false;
+    }
+
+    if (getSize() + total > _maxSize && !send()) {
+        return false;
+    }
+
+    // Keep a record in one piece in the buffer, so that it is appended to the file
+    // as a whole or not at all
+    if (_bufferCount + total > _bufferSize && !flushBuffer()) {
+        return false;
+    }
+
+    if (_format == HttpBatchLengthPrefixed) {
+        _buffer[_bufferCount++] = size >> 8;
+        _buffer[_bufferCount++] = size & 0xFF;
+    }
+    memcpy(&_buffer[_bufferCount], record, size);
+    _bufferCount += size;
+    if (_format == HttpBatchNewline) {
+        _buffer[_bufferCount++] = '\n';
+    }
+
+    if (_recordCount == 0) {
+        _firstRecordTime = millis();
+    }
+    _recordCount++;
+
+    return true;
+}
+
+bool Sodaq_3GbeeHttpBatch::poll()
+{
+    if (!isDue()) {
+        return true;
+    }
+
+    return send();
+}
+
+bool Sodaq_3GbeeHttpBatch::isDue() const
+{
+    if (_recordCount == 0) {
+        return false;
+    }
+
+    return getSize() >= _maxSize || (_maxAge > 0 && (millis() - _firstRecordTime) > _maxAge);
+}
+
+bool Sodaq_3GbeeHttpBatch::send()
+{
+    if (_recordCount == 0) {
+        return true;
+    }
+
+    if (!flushBuffer()) {
+        return false;
+    }
+
+    _lastStatusCode = 0;
+    if (_modem.httpPostFile(_server, _port, _endpoint, HTTP_BATCH_FILENAME, _contentType) == 0) {
+        return false;
+    }
+
+    const HttpResponseInfo_t* info = _modem.httpGetResponseInfo();
+    if (!info) {
+        return false;
+    }
+
+    _lastStatusCode = info->statusCode;
+    if (_lastStatusCode < 200 || _lastStatusCode >= 300) {
+        return false;
+    }
+
+    clear();
+    return true;
+}
+
+// Appends the staged records to the file on the modem.
+bool Sodaq_3GbeeHttpBatch::flushBuffer()
+{
+    if (_bufferCount == 0) {
+        return true;
+    }
+
+    if (!_modem.writeFile(HTTP_BATCH_FILENAME, _buffer, _bufferCount)) {
+        return false;
+    }
+
+    _fileSize += _bufferCount;
+    _bufferCount = 0;
+
+    return true;
+}
+
+void Sodaq_3GbeeHttpBatch::clear()
+{
+    _modem.deleteFile(HTTP_BATCH_FILENAME);
+    _bufferCount = 0;
+    _fileSize = 0;
+    _recordCount = 0;
+}
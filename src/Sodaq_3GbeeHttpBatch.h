@@ -0,0 +1,93 @@
+#ifndef SODAQ_3GBEE_HTTPBATCH_H_
+#define SODAQ_3GBEE_HTTPBATCH_H_
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "Sodaq_3Gbee.h"
+
+// The file on the modem that collects the records of a batch
+#define HTTP_BATCH_FILENAME "http_batch_0"
+
+// The default size limit of a batch
+#define DEFAULT_HTTP_BATCH_MAX_SIZE 4096
+
+// How the records are separated in the body of a batch.
+enum HttpBatchFormats {
+    HttpBatchNewline,           // each record is followed by a newline
+    HttpBatchLengthPrefixed     // each record is preceded by its length, 2 bytes big-endian
+};
+
+/*!
+ * \brief Collects records and sends them in a single HTTP POST.
+ *
+ * The records are staged in a RAM buffer and appended to a file on the
+ * modem each time the buffer is full. The batch is sent as the body of one
+ * POST when it reaches its size or age limit, so the connection, the DNS
+ * lookup and the handling of the response file are shared by all records.
+ * A batch that could not be sent is kept, and sent again with the next
+ * records.
+ */
+class Sodaq_3GbeeHttpBatch
+{
+public:
+    Sodaq_3GbeeHttpBatch(uint8_t* buffer, size_t size, Sodaq_3Gbee& modem = sodaq_3gbee);
+
+    // Starts a new batch for the given server and endpoint, any records collected
+    // earlier are dropped. The strings are not copied, they must stay valid.
+    // The age (ms) is counted from the first record, 0 means there is no age limit.
+    void begin(const char* server, uint16_t port, const char* endpoint,
+            HttpContentTypes contentType = HttpContentOctetStream,
+            HttpBatchFormats format = HttpBatchNewline,
+            uint32_t maxSize = DEFAULT_HTTP_BATCH_MAX_SIZE, uint32_t maxAge = 0);
+
+    // Adds a record to the batch. The batch is sent first if the record does not fit.
+    // A record (and its separator) must fit in the buffer given to the constructor.
+    // Returns false if the record could not be added.
+    bool add(const uint8_t* record, size_t size);
+    bool add(const char* record) { return add(reinterpret_cast<const uint8_t*>(record), strlen(record)); }
+
+    // Sends the batch if it has reached its age limit.
+    // Returns false if the batch is due but could not be sent.
+    bool poll();
+
+    // Returns true if the batch has reached its size or age limit
+    bool isDue() const;
+
+    // Sends the batch, if it is not empty.
+    // Returns true if the server accepted it (2xx).
+    bool send();
+
+    // Returns the number of records in the batch
+    uint16_t getRecordCount() const { return _recordCount; }
+
+    // Returns the size of the body of the batch
+    uint32_t getSize() const { return _fileSize + _bufferCount; }
+
+    // Returns the status code of the response to the last send(), or 0 if there was no response
+    uint16_t getLastStatusCode() const { return _lastStatusCode; }
+
+private:
+    bool flushBuffer();
+    void clear();
+
+    Sodaq_3Gbee& _modem;
+    uint8_t* _buffer;
+    size_t _bufferSize;
+    size_t _bufferCount;
+
+    const char* _server;
+    uint16_t _port;
+    const char* _endpoint;
+    HttpContentTypes _contentType;
+    HttpBatchFormats _format;
+    uint32_t _maxSize;
+    uint32_t _maxAge;
+
+    uint32_t _fileSize;
+    uint16_t _recordCount;
+    uint32_t _firstRecordTime;
+    uint16_t _lastStatusCode;
+};
+
+#endif /* SODAQ_3GBEE_HTTPBATCH_H_ */
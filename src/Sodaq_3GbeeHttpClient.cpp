@@ -0,0 +1,370 @@
+#include <Arduino.h>
+#include <Sodaq_wdt.h>
+
+#include "Sodaq_3GbeeHttpClient.h"
+
+// Passed as the body size to sendHeader() for a chunked body
+#define HTTP_BODY_CHUNKED -1
+
+static const char* const requestMethods[HttpRequestTypesMAX] = {
+    "POST",
+    "GET",
+    "HEAD",
+    "DELETE",
+    "PUT",
+};
+
+Sodaq_3GbeeHttpClient::Sodaq_3GbeeHttpClient(Sodaq_3Gbee& modem) :
+    _modem(modem)
+{
+    _socket = -1;
+    _host = NULL;
+    _port = 0;
+    _keepAlive = false;
+    _responseTimeout = DEFAULT_HTTP_CLIENT_RESPONSE_TIMEOUT;
+    _statusCode = -1;
+    _contentLength = -1;
+    _bodyState = BodyComplete;
+    _bodyRemaining = 0;
+    _bufferIndex = 0;
+    _bufferCount = 0;
+}
+
+int Sodaq_3GbeeHttpClient::request(HttpRequestTypes requestType, const char* host, uint16_t port,
+        const char* path, const uint8_t* body, size_t bodySize, const char* contentType)
+{
+    if (requestType >= HttpRequestTypesMAX || !connect(host, port)) {
+        return -1;
+    }
+
+    if (!body) {
+        bodySize = 0;
+    }
+
+    // Only POST and PUT always have a body, even if it is empty
+    int32_t length = (requestType == POST || requestType == PUT || bodySize > 0) ? bodySize : 0;
+    if (!sendHeader(requestType, host, path, contentType, length)
+            || (bodySize > 0 && !write(body, bodySize))
+            || !_modem.socketFlush(_socket)) {
+        stop();
+        return -1;
+    }
+
+    return readResponseHeader(requestType);
+}
+
+int Sodaq_3GbeeHttpClient::request(HttpRequestTypes requestType, const char* host, uint16_t port,
+        const char* path, HttpBodyProducerPtr producer, void* parameter, size_t bodySize,
+        const char* contentType)
+{
+    if (requestType >= HttpRequestTypesMAX || !producer || !connect(host, port)) {
+        return -1;
+    }
+
+    bool chunked = (bodySize == 0);
+    if (!sendHeader(requestType, host, path, contentType, chunked ? HTTP_BODY_CHUNKED : bodySize)) {
+        stop();
+        return -1;
+    }
+
+    // The receive buffer is not in use until the response arrives
+    bool status = true;
+    size_t size;
+    while (status && (size = producer(_buffer, sizeof(_buffer), parameter)) > 0) {
+        status = chunked ? writeChunk(_buffer, size) : write(_buffer, size);
+        sodaq_wdt_reset();
+    }
+    if (status && chunked) {
+        status = write("0\r\n\r\n");
+    }
+
+    if (!status || !_modem.socketFlush(_socket)) {
+        stop();
+        return -1;
+    }
+
+    return readResponseHeader(requestType);
+}
+
+size_t Sodaq_3GbeeHttpClient::read(uint8_t* buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size && _bodyState != BodyComplete) {
+        if (_bodyState == BodyChunkSize) {
+            if (!startChunk()) {
+                break;
+            }
+            continue;
+        }
+
+        if (_bufferIndex >= _bufferCount && !fillBuffer()) {
+            // The connection is closed, which is the end of the body if there is no length
+            if (_bodyState == BodyUntilClose) {
+                finishBody();
+            }
+            stop();
+            break;
+        }
+
+        size_t count = _bufferCount - _bufferIndex;
+        if (count > size - total) {
+            count = size - total;
+        }
+        if (_bodyState != BodyUntilClose && count > _bodyRemaining) {
+            count = _bodyRemaining;
+        }
+        memcpy(&buffer[total], &_buffer[_bufferIndex], count);
+        _bufferIndex += count;
+        total += count;
+
+        if (_bodyState == BodyLength || _bodyState == BodyChunkData) {
+            _bodyRemaining -= count;
+            if (_bodyRemaining == 0) {
+                if (_bodyState == BodyLength) {
+                    finishBody();
+                } else {
+                    // The CRLF after the chunk data
+                    char line[4];
+                    if (readLine(line, sizeof(line)) != 0) {
+                        stop();
+                        break;
+                    }
+                    _bodyState = BodyChunkSize;
+                }
+            }
+        }
+    }
+
+    return total;
+}
+
+int Sodaq_3GbeeHttpClient::read()
+{
+    uint8_t value;
+    if (read(&value, 1) != 1) {
+        return -1;
+    }
+
+    return value;
+}
+
+void Sodaq_3GbeeHttpClient::stop()
+{
+    if (_socket >= 0) {
+        _modem.closeSocket(_socket);
+        _socket = -1;
+    }
+    _bodyState = BodyComplete;
+    _bufferIndex = 0;
+    _bufferCount = 0;
+}
+
+// Connects to the given server, unless the connection of the previous request can be used.
+bool Sodaq_3GbeeHttpClient::connect(const char* host, uint16_t port)
+{
+    // Let +UUSOCL be handled, if the server has closed the connection
+    _modem.pollInput();
+
+    if (_socket >= 0) {
+        const SocketInfo_t* info = _modem.getSocketInfo(_socket);
+        if (_keepAlive && _bodyState == BodyComplete
+                && info && info->state == SocketConnected && !info->closed
+                && _port == port && _host && strcmp(_host, host) == 0) {
+            return true;
+        }
+
+        stop();
+    }
+
+    _socket = _modem.openSocket(TCP, host, port);
+    if (_socket < 0) {
+        return false;
+    }
+
+    if (!_host || strcmp(_host, host) != 0) {
+        _host = static_cast<char*>(realloc(_host, strlen(host) + 1));
+        strcpy(_host, host);
+    }
+    _port = port;
+    _bufferIndex = 0;
+    _bufferCount = 0;
+
+    return true;
+}
+
+bool Sodaq_3GbeeHttpClient::sendHeader(HttpRequestTypes requestType, const char* host,
+        const char* path, const char* contentType, int32_t bodySize)
+{
+    char number[12];
+
+    bool status = write(requestMethods[requestType])
+            && write(" ")
+            && write(path)
+            && write(" HTTP/1.1\r\nHost: ")
+            && write(host)
+            && write("\r\nConnection: keep-alive\r\n");
+
+    if (status && contentType) {
+        status = write("Content-Type: ") && write(contentType) && write("\r\n");
+    }
+
+    if (status && bodySize == HTTP_BODY_CHUNKED) {
+        status = write("Transfer-Encoding: chunked\r\n");
+    } else if (status && (bodySize > 0 || requestType == POST || requestType == PUT)) {
+        snprintf(number, sizeof(number), "%lu", static_cast<unsigned long>(bodySize));
+        status = write("Content-Length: ") && write(number) && write("\r\n");
+    }
+
+    return status && write("\r\n");
+}
+
+bool Sodaq_3GbeeHttpClient::write(const char* str)
+{
+    return write(reinterpret_cast<const uint8_t*>(str), strlen(str));
+}
+
+bool Sodaq_3GbeeHttpClient::write(const uint8_t* buffer, size_t size)
+{
+    // Buffered, so that the small parts of the header go out in one AT+USOWR
+    return _modem.socketWrite(_socket, buffer, size);
+}
+
+bool Sodaq_3GbeeHttpClient::writeChunk(const uint8_t* buffer, size_t size)
+{
+    char chunkSize[12];
+    snprintf(chunkSize, sizeof(chunkSize), "%X\r\n", static_cast<unsigned int>(size));
+
+    return write(chunkSize) && write(buffer, size) && write("\r\n");
+}
+
+// Reads the status line and the header lines of the response.
+// Returns the status code, or -1 in case of error.
+int Sodaq_3GbeeHttpClient::readResponseHeader(HttpRequestTypes requestType)
+{
+    char line[HTTP_CLIENT_LINE_SIZE];
+    bool chunked;
+
+    _bodyState = BodyUntilClose;
+    do {
+        // HTTP/1.1 200 OK
+        _statusCode = -1;
+        if (readLine(line, sizeof(line)) <= 0 || sscanf(line, "HTTP/%*s %d", &_statusCode) != 1) {
+            stop();
+            return -1;
+        }
+        _keepAlive = (strncmp(line, "HTTP/1.0", 8) != 0);
+        _contentLength = -1;
+        chunked = false;
+
+        int len;
+        while ((len = readLine(line, sizeof(line))) > 0) {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                _contentLength = strtol(&line[15], NULL, 10);
+            } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+                chunked = (strstr(&line[18], "chunked") != NULL);
+            } else if (strncasecmp(line, "Connection:", 11) == 0) {
+                _keepAlive = (strstr(&line[11], "close") == NULL);
+            }
+        }
+        if (len < 0) {
+            stop();
+            return -1;
+        }
+
+        // Skip interim responses, like 100 Continue
+    } while (_statusCode >= 100 && _statusCode < 200);
+
+    if (requestType == HEAD || _statusCode == 204 || _statusCode == 304) {
+        finishBody();
+    } else if (chunked) {
+        _bodyState = BodyChunkSize;
+    } else if (_contentLength >= 0) {
+        _bodyState = BodyLength;
+        _bodyRemaining = _contentLength;
+        if (_bodyRemaining == 0) {
+            finishBody();
+        }
+    } else {
+        // The body ends when the server closes the connection
+        _keepAlive = false;
+    }
+
+    return _statusCode;
+}
+
+bool Sodaq_3GbeeHttpClient::fillBuffer()
+{
+    if (_socket < 0) {
+        return false;
+    }
+
+    // Don't wait for data that will not come
+    const SocketInfo_t* info = _modem.getSocketInfo(_socket);
+    if (!info || (info->closed && info->pendingBytes == 0)) {
+        return false;
+    }
+
+    _bufferIndex = 0;
+    _bufferCount = _modem.socketReceive(_socket, _buffer, sizeof(_buffer), _responseTimeout);
+
+    return _bufferCount > 0;
+}
+
+// Reads a line of the response, without the CRLF. Lines that are too long are truncated.
+// Returns the length of the line, or -1 if the connection is closed.
+int Sodaq_3GbeeHttpClient::readLine(char* line, size_t size)
+{
+    size_t len = 0;
+    for (;;) {
+        if (_bufferIndex >= _bufferCount && !fillBuffer()) {
+            return -1;
+        }
+
+        char c = _buffer[_bufferIndex++];
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && len < size - 1) {
+            line[len++] = c;
+        }
+    }
+    line[len] = '\0';
+
+    return len;
+}
+
+// Reads the size line of the next chunk, the last chunk ends the body.
+bool Sodaq_3GbeeHttpClient::startChunk()
+{
+    char line[HTTP_CLIENT_LINE_SIZE];
+    if (readLine(line, sizeof(line)) <= 0) {
+        stop();
+        return false;
+    }
+
+    _bodyRemaining = strtoul(line, NULL, 16);
+    if (_bodyRemaining > 0) {
+        _bodyState = BodyChunkData;
+        return true;
+    }
+
+    // Skip the trailer, up to the empty line
+    int len;
+    while ((len = readLine(line, sizeof(line))) > 0) {
+    }
+    if (len < 0) {
+        stop();
+        return false;
+    }
+
+    finishBody();
+    return true;
+}
+
+void Sodaq_3GbeeHttpClient::finishBody()
+{
+    _bodyState = BodyComplete;
+    if (!_keepAlive) {
+        stop();
+    }
+}
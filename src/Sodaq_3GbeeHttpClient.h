@@ -0,0 +1,108 @@
+#ifndef SODAQ_3GBEE_HTTPCLIENT_H_
+#define SODAQ_3GBEE_HTTPCLIENT_H_
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "Sodaq_3Gbee.h"
+
+// The size of the receive buffer and the longest header line that is parsed.
+// Each AT+USORD reads up to a buffer full.
+#define HTTP_CLIENT_BUFFER_SIZE 256
+#define HTTP_CLIENT_LINE_SIZE 96
+
+// How long (ms) the client waits for the next part of a response by default
+#define DEFAULT_HTTP_CLIENT_RESPONSE_TIMEOUT 30000
+
+// Producer of a request body, see Sodaq_3GbeeHttpClient::request() and DataProducerPtr.
+typedef DataProducerPtr HttpBodyProducerPtr;
+
+/*!
+ * \brief An HTTP/1.1 client on top of the modem sockets.
+ *
+ * Unlike Sodaq_3Gbee::httpRequest() it does not go through the HTTP engine
+ * and the filesystem of the modem. The request is written straight to a
+ * TCP socket and the response is parsed as it arrives. The connection is
+ * kept open for the next request to the same server, unless the server
+ * asks to close it.
+ */
+class Sodaq_3GbeeHttpClient
+{
+public:
+    Sodaq_3GbeeHttpClient(Sodaq_3Gbee& modem = sodaq_3gbee);
+
+    // Sets how long (ms) to wait for the server, for the response and for each part of it
+    void setResponseTimeout(uint32_t timeout) { _responseTimeout = timeout; }
+
+    // Sends a request with an (optional) body from RAM and reads the response header.
+    // The body of the response can then be read with read().
+    // Returns the HTTP status code, or -1 in case of error.
+    int request(HttpRequestTypes requestType, const char* host, uint16_t port, const char* path,
+            const uint8_t* body = NULL, size_t bodySize = 0, const char* contentType = NULL);
+
+    // Sends a request with a body that is produced by the given callback, see HttpBodyProducerPtr.
+    // If the size of the body is not known in advance, pass 0 and the body is sent chunked.
+    // Returns the HTTP status code, or -1 in case of error.
+    int request(HttpRequestTypes requestType, const char* host, uint16_t port, const char* path,
+            HttpBodyProducerPtr producer, void* parameter, size_t bodySize = 0, const char* contentType = NULL);
+
+    // Returns the status code of the last response
+    int getStatusCode() const { return _statusCode; }
+
+    // Returns the Content-Length of the last response, or -1 if it is not known
+    int32_t getContentLength() const { return _contentLength; }
+
+    // Reads the body of the response into the given buffer.
+    // Returns the number of bytes read, 0 at the end of the body.
+    size_t read(uint8_t* buffer, size_t size);
+
+    // Reads a single byte of the body of the response.
+    // Returns -1 at the end of the body.
+    int read();
+
+    // Returns true if the whole body of the response is read
+    bool isBodyComplete() const { return _bodyState == BodyComplete; }
+
+    // Closes the connection
+    void stop();
+
+private:
+    enum BodyStates {
+        BodyComplete,
+        BodyLength,             // _bodyRemaining bytes left
+        BodyChunkSize,          // the next line has the size of a chunk
+        BodyChunkData,          // _bodyRemaining bytes left in the chunk
+        BodyUntilClose,         // neither a Content-Length, nor chunked
+    };
+
+    bool connect(const char* host, uint16_t port);
+    bool sendHeader(HttpRequestTypes requestType, const char* host, const char* path,
+            const char* contentType, int32_t bodySize);
+    bool write(const char* str);
+    bool write(const uint8_t* buffer, size_t size);
+    bool writeChunk(const uint8_t* buffer, size_t size);
+    int readResponseHeader(HttpRequestTypes requestType);
+
+    bool fillBuffer();
+    int readLine(char* line, size_t size);
+    bool startChunk();
+    void finishBody();
+
+    Sodaq_3Gbee& _modem;
+    int _socket;
+    char* _host;
+    uint16_t _port;
+    bool _keepAlive;
+    uint32_t _responseTimeout;
+
+    int _statusCode;
+    int32_t _contentLength;
+    BodyStates _bodyState;
+    uint32_t _bodyRemaining;
+
+    uint8_t _buffer[HTTP_CLIENT_BUFFER_SIZE];
+    size_t _bufferIndex;
+    size_t _bufferCount;
+};
+
+#endif /* SODAQ_3GBEE_HTTPCLIENT_H_ */
@@ -0,0 +1,294 @@
+#include <Arduino.h>
+#include <Sodaq_wdt.h>
+
+#include "Sodaq_3GbeeUploadQueue.h"
+
+// The longest filename of a queue: the name, an underscore and a number or "idx"
+#define UPLOAD_QUEUE_FILENAME_SIZE (UPLOAD_QUEUE_NAME_SIZE + 7)
+
+// The parameter of _socketChunkCallback()
+struct UploadQueueSocketParameter_t {
+    Sodaq_3Gbee* modem;
+    uint8_t socket;
+    uint32_t sent;
+};
+
+Sodaq_3GbeeUploadQueue::Sodaq_3GbeeUploadQueue(Sodaq_3Gbee& modem) :
+    _modem(modem)
+{
+    _name[0] = '\0';
+    _format = HttpBatchNewline;
+    _segmentSize = DEFAULT_UPLOAD_QUEUE_SEGMENT_SIZE;
+    _maxBytes = 0;
+    _reserveBytes = DEFAULT_UPLOAD_QUEUE_RESERVE;
+    _dropOldest = false;
+    _head = 0;
+    _tail = 0;
+    _tailSize = 0;
+    _queuedBytes = 0;
+}
+
+bool Sodaq_3GbeeUploadQueue::begin(const char* name, HttpBatchFormats format, uint32_t segmentSize)
+{
+    strncpy(_name, name, sizeof(_name) - 1);
+    _name[sizeof(_name) - 1] = '\0';
+    _format = format;
+    _segmentSize = segmentSize;
+    _head = 0;
+    _tail = 0;
+    _tailSize = 0;
+    _queuedBytes = 0;
+
+    // The index file has "<head>,<tail>", it does not exist for a new queue
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    getFilename("idx", 0, filename, sizeof(filename));
+    uint32_t size;
+    if (_modem.getFileSize(filename, size)) {
+        char index[16];
+        size_t len = _modem.readFile(filename, reinterpret_cast<uint8_t*>(index), sizeof(index) - 1);
+        index[len] = '\0';
+
+        unsigned int head;
+        unsigned int tail;
+        if (sscanf(index, "%u,%u", &head, &tail) != 2 || head > 0xFFFF || tail > 0xFFFF
+                || static_cast<uint16_t>(tail - head) >= UPLOAD_QUEUE_MAX_SEGMENTS) {
+            _name[0] = '\0';
+            return false;
+        }
+        _head = head;
+        _tail = tail;
+    }
+
+    for (uint16_t segment = _head; ; segment++) {
+        uint32_t segmentSize = getSegmentSize(segment);
+        _queuedBytes += segmentSize;
+        if (segment == _tail) {
+            _tailSize = segmentSize;
+            break;
+        }
+        sodaq_wdt_reset();
+    }
+
+    return true;
+}
+
+void Sodaq_3GbeeUploadQueue::setQuota(uint32_t maxBytes, uint32_t reserveBytes, bool dropOldest)
+{
+    _maxBytes = maxBytes;
+    _reserveBytes = reserveBytes;
+    _dropOldest = dropOldest;
+}
+
+bool Sodaq_3GbeeUploadQueue::push(const uint8_t* record, size_t size)
+{
+    uint32_t total = size + ((_format == HttpBatchLengthPrefixed) ? 2 : 1);
+    if (!_name[0] || total > _segmentSize
+            || (_format == HttpBatchLengthPrefixed && size > 0xFFFF)) {
+        return false;
+    }
+
+    bool newSegment = (_tailSize + total > _segmentSize);
+    if (!makeRoom(total, newSegment) || (newSegment && !startSegment())) {
+        return false;
+    }
+
+    // The record and its separator go in one AT+UDWNFILE, which appends to the segment
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    getFilename(NULL, _tail, filename, sizeof(filename));
+    bool status;
+    if (_format == HttpBatchLengthPrefixed) {
+        uint8_t length[2] = { static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size & 0xFF) };
+        status = _modem.writeFile(filename, length, sizeof(length), record, size);
+    } else {
+        status = _modem.writeFile(filename, record, size, reinterpret_cast<const uint8_t*>("\n"), 1);
+    }
+    if (!status) {
+        return false;
+    }
+
+    _tailSize += total;
+    _queuedBytes += total;
+
+    return true;
+}
+
+uint16_t Sodaq_3GbeeUploadQueue::drainHttp(const char* server, uint16_t port, const char* endpoint,
+        HttpContentTypes contentType, uint16_t maxSegments)
+{
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    uint16_t count = 0;
+    while (!isEmpty() && count < maxSegments) {
+        // An empty (or lost) segment is skipped
+        if (getSegmentSize(_head) > 0) {
+            getFilename(NULL, _head, filename, sizeof(filename));
+            if (_modem.httpPostFile(server, port, endpoint, filename, contentType) == 0) {
+                break;
+            }
+
+            const HttpResponseInfo_t* info = _modem.httpGetResponseInfo();
+            if (!info || info->statusCode < 200 || info->statusCode >= 300) {
+                break;
+            }
+            count++;
+        }
+
+        if (!dropSegment()) {
+            break;
+        }
+        sodaq_wdt_reset();
+    }
+
+    return count;
+}
+
+uint16_t Sodaq_3GbeeUploadQueue::drainSocket(uint8_t socket, uint8_t* buffer, size_t size, uint16_t maxSegments)
+{
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    uint16_t count = 0;
+    while (!isEmpty() && count < maxSegments) {
+        uint32_t segmentSize = getSegmentSize(_head);
+        if (segmentSize > 0) {
+            getFilename(NULL, _head, filename, sizeof(filename));
+
+            UploadQueueSocketParameter_t parameter = { &_modem, socket, 0 };
+            uint32_t read = _modem.readFileChunks(filename, buffer, size, _socketChunkCallback, &parameter);
+            if (read != segmentSize || parameter.sent != segmentSize || !_modem.socketFlush(socket)) {
+                // The rest must not go out in front of the next data on the socket
+                _modem.discardSocketWrites(socket);
+                break;
+            }
+            count++;
+        }
+
+        if (!dropSegment()) {
+            break;
+        }
+        sodaq_wdt_reset();
+    }
+
+    return count;
+}
+
+uint16_t Sodaq_3GbeeUploadQueue::getSegmentCount() const
+{
+    if (isEmpty()) {
+        return 0;
+    }
+
+    return static_cast<uint16_t>(_tail - _head) + 1;
+}
+
+// Gets the name of the file with the given suffix, or of the given segment if the suffix is NULL.
+void Sodaq_3GbeeUploadQueue::getFilename(const char* suffix, uint16_t segment, char* buffer, size_t size) const
+{
+    if (suffix) {
+        snprintf(buffer, size, "%s_%s", _name, suffix);
+    } else {
+        snprintf(buffer, size, "%s_%u", _name, segment);
+    }
+}
+
+// Returns the size of the given segment, 0 if it does not exist.
+uint32_t Sodaq_3GbeeUploadQueue::getSegmentSize(uint16_t segment)
+{
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    getFilename(NULL, segment, filename, sizeof(filename));
+
+    uint32_t size = 0;
+    if (!_modem.getFileSize(filename, size)) {
+        return 0;
+    }
+
+    return size;
+}
+
+// Makes room for the given number of bytes within the quota, if needed by dropping the
+// oldest segments. The free space of the filesystem is only checked for a new segment.
+bool Sodaq_3GbeeUploadQueue::makeRoom(uint32_t size, bool newSegment)
+{
+    for (;;) {
+        bool full = (_maxBytes > 0 && _queuedBytes + size > _maxBytes);
+        if (!full && newSegment) {
+            uint32_t freeSpace;
+            if (!_modem.getRemainingFreeSpace(freeSpace)) {
+                return false;
+            }
+            full = (freeSpace < _reserveBytes + _segmentSize
+                    || static_cast<uint16_t>(_tail - _head) + 1 >= UPLOAD_QUEUE_MAX_SEGMENTS);
+        }
+
+        if (!full) {
+            return true;
+        }
+
+        // The segment that is appended to is never dropped
+        if (!_dropOldest || _head == _tail || !dropSegment()) {
+            return false;
+        }
+    }
+}
+
+// Starts appending to the next segment.
+bool Sodaq_3GbeeUploadQueue::startSegment()
+{
+    if (_tailSize == 0) {
+        return true;
+    }
+
+    _tail++;
+    _tailSize = 0;
+
+    // A leftover of an earlier round of the segment numbers
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    getFilename(NULL, _tail, filename, sizeof(filename));
+    _modem.deleteFile(filename);
+
+    return saveIndex();
+}
+
+// Removes the oldest segment from the queue.
+bool Sodaq_3GbeeUploadQueue::dropSegment()
+{
+    uint32_t size = getSegmentSize(_head);
+
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    getFilename(NULL, _head, filename, sizeof(filename));
+    if (size > 0 && !_modem.deleteFile(filename)) {
+        return false;
+    }
+    _queuedBytes -= (size < _queuedBytes) ? size : _queuedBytes;
+
+    // The last segment stays the one that is appended to
+    if (_head == _tail) {
+        _tailSize = 0;
+        _queuedBytes = 0;
+        return true;
+    }
+
+    _head++;
+    return saveIndex();
+}
+
+bool Sodaq_3GbeeUploadQueue::saveIndex()
+{
+    char filename[UPLOAD_QUEUE_FILENAME_SIZE + 1];
+    getFilename("idx", 0, filename, sizeof(filename));
+
+    char index[16];
+    size_t len = snprintf(index, sizeof(index), "%u,%u", _head, _tail);
+
+    _modem.deleteFile(filename);
+    return _modem.writeFile(filename, reinterpret_cast<const uint8_t*>(index), len);
+}
+
+bool Sodaq_3GbeeUploadQueue::_socketChunkCallback(const uint8_t* buffer, size_t size, uint32_t offset, void* parameter)
+{
+    UploadQueueSocketParameter_t* socketParameter = static_cast<UploadQueueSocketParameter_t*>(parameter);
+
+    if (!socketParameter->modem->socketWrite(socketParameter->socket, buffer, size)) {
+        return false;
+    }
+    socketParameter->sent += size;
+
+    return true;
+}
@@ -0,0 +1,105 @@
+#ifndef SODAQ_3GBEE_UPLOADQUEUE_H_
+#define SODAQ_3GBEE_UPLOADQUEUE_H_
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "Sodaq_3Gbee.h"
+#include "Sodaq_3GbeeHttpBatch.h"
+
+// The default prefix of the files of a queue
+#define UPLOAD_QUEUE_NAME "upq"
+
+// The longest prefix of the files of a queue
+#define UPLOAD_QUEUE_NAME_SIZE 16
+
+// The default size of a segment, that is a file of the queue
+#define DEFAULT_UPLOAD_QUEUE_SEGMENT_SIZE 4096
+
+// The most segments a queue can have, a longer index is taken to be corrupt
+#define UPLOAD_QUEUE_MAX_SEGMENTS 512
+
+// The default free space that is left on the modem filesystem
+#define DEFAULT_UPLOAD_QUEUE_RESERVE 16384
+
+/*!
+ * \brief A store-and-forward FIFO queue of records in the modem filesystem.
+ *
+ * The records are appended to numbered files (segments) on the modem, they
+ * don't take any MCU RAM. The numbers of the oldest and the newest segment
+ * are kept in an index file, so the queue survives a reset of the MCU.
+ *
+ * Once there is a connection the queue is drained a segment at a time: each
+ * segment is sent in one HTTP POST or one socket stream and then deleted.
+ * The records in a segment are separated as in Sodaq_3GbeeHttpBatch.
+ */
+class Sodaq_3GbeeUploadQueue
+{
+public:
+    Sodaq_3GbeeUploadQueue(Sodaq_3Gbee& modem = sodaq_3gbee);
+
+    // Opens the queue with the given name on the modem, it is created if it does not exist.
+    // Returns false if the queue could not be read, or its index is corrupt.
+    bool begin(const char* name = UPLOAD_QUEUE_NAME, HttpBatchFormats format = HttpBatchNewline,
+            uint32_t segmentSize = DEFAULT_UPLOAD_QUEUE_SEGMENT_SIZE);
+
+    // Limits the queue to maxBytes (0 means no limit), and keeps at least reserveBytes free
+    // on the modem filesystem. When the queue is full the oldest segment is dropped if
+    // dropOldest is true, otherwise push() fails.
+    void setQuota(uint32_t maxBytes, uint32_t reserveBytes = DEFAULT_UPLOAD_QUEUE_RESERVE,
+            bool dropOldest = false);
+
+    // Appends a record to the queue.
+    // Returns false if the record could not be stored.
+    bool push(const uint8_t* record, size_t size);
+    bool push(const char* record) { return push(reinterpret_cast<const uint8_t*>(record), strlen(record)); }
+
+    // Sends the oldest segments, each in one HTTP POST, and removes them from the queue.
+    // Stops at the first segment that is not accepted (2xx) by the server.
+    // Returns the number of segments sent.
+    uint16_t drainHttp(const char* server, uint16_t port, const char* endpoint,
+            HttpContentTypes contentType = HttpContentOctetStream, uint16_t maxSegments = 0xFFFF);
+
+    // Sends the oldest segments over the given (connected) socket, and removes them from
+    // the queue. The buffer is used to read the segments from the modem.
+    // Returns the number of segments sent.
+    // NOTE: a segment that fails may have been sent in part, it stays in the queue. Close
+    // (or reset) the socket before draining again, the server would get it twice otherwise.
+    uint16_t drainSocket(uint8_t socket, uint8_t* buffer, size_t size, uint16_t maxSegments = 0xFFFF);
+
+    // Returns true if there are no records in the queue
+    bool isEmpty() const { return _queuedBytes == 0; }
+
+    // Returns the number of bytes in the queue
+    uint32_t getSize() const { return _queuedBytes; }
+
+    // Returns the number of segments in the queue
+    uint16_t getSegmentCount() const;
+
+private:
+    void getFilename(const char* suffix, uint16_t segment, char* buffer, size_t size) const;
+    uint32_t getSegmentSize(uint16_t segment);
+    bool makeRoom(uint32_t size, bool newSegment);
+    bool startSegment();
+    bool dropSegment();
+    bool saveIndex();
+
+    static bool _socketChunkCallback(const uint8_t* buffer, size_t size, uint32_t offset, void* parameter);
+
+    Sodaq_3Gbee& _modem;
+    char _name[UPLOAD_QUEUE_NAME_SIZE + 1];
+    HttpBatchFormats _format;
+    uint32_t _segmentSize;
+
+    uint32_t _maxBytes;
+    uint32_t _reserveBytes;
+    bool _dropOldest;
+
+    // The oldest segment and the segment that records are appended to
+    uint16_t _head;
+    uint16_t _tail;
+    uint32_t _tailSize;
+    uint32_t _queuedBytes;
+};
+
+#endif /* SODAQ_3GBEE_UPLOADQUEUE_H_ */
@@ -54,6 +54,8 @@ Sodaq_GSM_Modem::Sodaq_GSM_Modem() :
     _disableDiag(false),
     _inputBufferSize(SODAQ_GSM_MODEM_DEFAULT_INPUT_BUFFER_SIZE),
     _inputBuffer(0),
+    _inputHead(0),
+    _inputTail(0),
     _apn(0),
     _apnUser(0),
     _apnPass(0),
@@ -66,6 +68,9 @@ Sodaq_GSM_Modem::Sodaq_GSM_Modem() :
     _minRSSI(-93),      // -93 dBm
     _echoOff(false),
     _startOn(0),
+    _powerCycleCount(0),
+    _commandSentAt(0),
+    _commandOutstanding(false),
     _tcpClosedHandler(0)
 {
     this->_isBufferInitialized = false;
@@ -80,6 +85,7 @@ bool Sodaq_GSM_Modem::on()
         if (_onoff) {
             _onoff->on();
         }
+        _powerCycleCount++;
     }
 
     // wait for power up
@@ -106,6 +112,7 @@ bool Sodaq_GSM_Modem::off()
     if (_onoff) {
         _onoff->off();
     }
+    _powerCycleCount++;
 
     _echoOff = false;
 
@@ -126,6 +133,7 @@ bool Sodaq_GSM_Modem::isOn() const
 void Sodaq_GSM_Modem::writeProlog()
 {
     if (!_appendCommand) {
+        beforeCommand();
         debugPrint(">> ");
         _appendCommand = true;
     }
@@ -278,6 +286,8 @@ size_t Sodaq_GSM_Modem::println(void)
     debugPrintLn();
     size_t i = print('\r');
     _appendCommand = false;
+    _commandSentAt = millis();
+    _commandOutstanding = true;
     return i;
 }
 
@@ -349,16 +359,100 @@ void Sodaq_GSM_Modem::setPin(const char * pin)
     strcpy(_pin, pin);
 }
 
+// Moves the characters that are available on the modem stream into the input buffer,
+// without blocking. Returns the number of characters in the input buffer that are
+// not consumed yet.
+size_t Sodaq_GSM_Modem::fillInputBuffer()
+{
+    if (!_inputBuffer || !_modemStream) {
+        return 0;
+    }
+
+    if (_inputHead == _inputTail) {
+        _inputHead = 0;
+        _inputTail = 0;
+    }
+
+    int available = _modemStream->available();
+    if (available > 0) {
+        // The last byte is kept free for a null terminator, see findInInputBuffer()
+        size_t capacity = _inputBufferSize - 1;
+        if (_inputTail + available > capacity && _inputHead > 0) {
+            memmove(_inputBuffer, &_inputBuffer[_inputHead], _inputTail - _inputHead);
+            _inputTail -= _inputHead;
+            _inputHead = 0;
+        }
+
+        size_t count = capacity - _inputTail;
+        if (static_cast<size_t>(available) < count) {
+            count = available;
+        }
+        while (count-- > 0) {
+            int c = _modemStream->read();
+            if (c < 0) {
+                break;
+            }
+            _inputBuffer[_inputTail++] = static_cast<char>(c);
+        }
+    }
+
+    return _inputTail - _inputHead;
+}
+
+// Consumes up to the given terminator if it is in the input buffer, see readUntilView().
+bool Sodaq_GSM_Modem::findInInputBuffer(char terminator, char*& view, size_t& len)
+{
+    char* start = &_inputBuffer[_inputHead];
+    size_t count = _inputTail - _inputHead;
+
+    char* found = static_cast<char*>(memchr(start, terminator, count));
+    if (found) {
+        len = found - start;
+        _inputHead += len + 1;
+    } else if (count >= _inputBufferSize - 1) {
+        // The buffer is full, hand it out as it is
+        len = count;
+        _inputHead = _inputTail;
+    } else {
+        return false;
+    }
+
+    start[len] = '\0';
+    view = start;
+
+    return true;
+}
+
+// Consumes a prompt if it is at the start of the input buffer, see readUntilView().
+bool Sodaq_GSM_Modem::findPromptInInputBuffer(const char* prompts, char*& view, size_t& len)
+{
+    if (_inputHead == _inputTail) {
+        return false;
+    }
+
+    char c = _inputBuffer[_inputHead];
+    if (c == '\0' || strchr(prompts, c) == NULL) {
+        return false;
+    }
+
+    // Only the prompt is consumed, what follows it is kept for the next read
+    _inputHead++;
+    _promptView[0] = c;
+    _promptView[1] = '\0';
+    view = _promptView;
+    len = 1;
+
+    return true;
+}
+
 // Returns a character from the modem stream if read within _timeout ms or -1 otherwise.
-int Sodaq_GSM_Modem::timedRead(uint32_t timeout) const
+int Sodaq_GSM_Modem::timedRead(uint32_t timeout)
 {
-    int c;
     uint32_t _startMillis = millis();
 
     do {
-        c = _modemStream->read();
-        if (c >= 0) {
-            return c;
+        if (_inputHead < _inputTail || fillInputBuffer() > 0) {
+            return static_cast<uint8_t>(_inputBuffer[_inputHead++]);
         }
     } while (millis() - _startMillis < timeout);
 
@@ -377,19 +471,43 @@ size_t Sodaq_GSM_Modem::readBytesUntil(char terminator, char* buffer, size_t len
     }
 
     size_t index = 0;
+    uint32_t startMillis = millis();
 
     while (index < length) {
-        int c = timedRead(timeout);
+        size_t available = _inputTail - _inputHead;
+        if (available == 0) {
+            available = fillInputBuffer();
+            if (available == 0) {
+                if (millis() - startMillis >= timeout) {
+                    break;
+                }
+                continue;
+            }
+        }
 
-        if (c < 0 || c == terminator) {
-            break;
+        size_t count = length - index;
+        if (available < count) {
+            count = available;
+        }
+
+        const char* start = &_inputBuffer[_inputHead];
+        const char* found = static_cast<const char*>(memchr(start, terminator, count));
+        if (found) {
+            count = found - start;
         }
 
-        *buffer++ = static_cast<char>(c);
-        index++;
+        memcpy(&buffer[index], start, count);
+        index += count;
+        _inputHead += count;
+
+        if (found) {
+            _inputHead++; // the terminator
+            break;
+        }
+        startMillis = millis();
     }
     if (index < length) {
-        *buffer = '\0';
+        buffer[index] = '\0';
     }
 
     // TODO distinguise timeout from empty string?
@@ -403,16 +521,28 @@ size_t Sodaq_GSM_Modem::readBytesUntil(char terminator, char* buffer, size_t len
 size_t Sodaq_GSM_Modem::readBytes(uint8_t* buffer, size_t length, uint32_t timeout)
 {
     size_t count = 0;
+    uint32_t startMillis = millis();
 
     while (count < length) {
-        int c = timedRead(timeout);
+        size_t available = _inputTail - _inputHead;
+        if (available == 0) {
+            available = fillInputBuffer();
+            if (available == 0) {
+                if (millis() - startMillis >= timeout) {
+                    break;
+                }
+                continue;
+            }
+        }
 
-        if (c < 0) {
-            break;
+        size_t chunk = length - count;
+        if (available < chunk) {
+            chunk = available;
         }
-        
-        *buffer++ = static_cast<uint8_t>(c);
-        count++;
+        memcpy(&buffer[count], &_inputBuffer[_inputHead], chunk);
+        _inputHead += chunk;
+        count += chunk;
+        startMillis = millis();
     }
 
     // TODO distinguise timeout from empty string?
@@ -420,22 +550,118 @@ size_t Sodaq_GSM_Modem::readBytes(uint8_t* buffer, size_t length, uint32_t timeo
     return count;
 }
 
+static uint8_t hexCharToNibble(char c)
+{
+    if (c >= 'a') {
+        return c - 'a' + 0x0A;
+    }
+    if (c >= 'A') {
+        return c - 'A' + 0x0A;
+    }
+    return c - '0';
+}
+
+size_t Sodaq_GSM_Modem::readHexBytes(uint8_t* buffer, size_t length, uint32_t timeout)
+{
+    size_t count = 0;
+    uint32_t startMillis = millis();
+
+    while (count < length) {
+        // Only whole pairs are decoded, a trailing half pair waits for the next fill
+        size_t pairs = (_inputTail - _inputHead) / 2;
+        if (pairs == 0) {
+            pairs = fillInputBuffer() / 2;
+            if (pairs == 0) {
+                if (millis() - startMillis >= timeout) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (pairs > length - count) {
+            pairs = length - count;
+        }
+        const char* hex = &_inputBuffer[_inputHead];
+        for (size_t i = 0; i < pairs; i++) {
+            buffer[count++] = (hexCharToNibble(hex[0]) << 4) | hexCharToNibble(hex[1]);
+            hex += 2;
+        }
+        _inputHead += pairs * 2;
+        startMillis = millis();
+    }
+
+    return count;
+}
+
+// Reads from the modem stream until the "terminator" is found, or the timeout.
+// The terminator is replaced by null. The view is valid until the next read.
+// Returns false on timeout, the characters read so far are kept for the next read.
+bool Sodaq_GSM_Modem::readUntilView(char terminator, char*& view, size_t& len, uint32_t timeout,
+        const char* prompts)
+{
+    if (!_inputBuffer) {
+        return false;
+    }
+
+    uint32_t startMillis = millis();
+    do {
+        fillInputBuffer();
+        if ((prompts && findPromptInInputBuffer(prompts, view, len))
+                || findInInputBuffer(terminator, view, len)) {
+            return true;
+        }
+    } while (millis() - startMillis < timeout);
+
+    return false;
+}
+
+// Reads a line (up to the SODAQ_GSM_TERMINATOR) from the modem stream, without copying.
+bool Sodaq_GSM_Modem::readLnView(char*& line, size_t& len, uint32_t timeout, const char* prompts)
+{
+    if (!readUntilView(SODAQ_GSM_TERMINATOR[SODAQ_GSM_TERMINATOR_LEN - 1], line, len, timeout, prompts)) {
+        return false;
+    }
+
+    // check if the terminator is more than 1 characters, then check if the first character of it exists
+    // in the calculated position and terminate the string there
+    if ((SODAQ_GSM_TERMINATOR_LEN > 1) && (len > 0) && (line[len - 1] == SODAQ_GSM_TERMINATOR[0])) {
+        len--;
+        line[len] = '\0';
+    }
+
+    return true;
+}
+
 // Reads a line (up to the SODAQ_GSM_TERMINATOR) from the modem stream into the "buffer".
 // The buffer is terminated with null.
 // Returns the number of bytes read, not including the null terminator.
 size_t Sodaq_GSM_Modem::readLn(char* buffer, size_t size, uint32_t timeout)
 {
-    // Use size-1 to leave room for a string terminator
-    size_t len = readBytesUntil(SODAQ_GSM_TERMINATOR[SODAQ_GSM_TERMINATOR_LEN - 1], buffer, size - 1, timeout);
-
-    // check if the terminator is more than 1 characters, then check if the first character of it exists 
-    // in the calculated position and terminate the string there
-    if ((SODAQ_GSM_TERMINATOR_LEN > 1) && (buffer[len - (SODAQ_GSM_TERMINATOR_LEN - 1)] == SODAQ_GSM_TERMINATOR[0])) {
-        len -= SODAQ_GSM_TERMINATOR_LEN - 1;
+    char* line;
+    size_t len;
+    if (size == 0) {
+        return 0;
+    }
+    if (!readLnView(line, len, timeout)) {
+        buffer[0] = '\0';
+        return 0;
     }
 
-    // terminate string, there should always be room for it (see size-1 above)
+    // Use size-1 to leave room for a string terminator
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    // The buffer may be the input buffer itself
+    memmove(buffer, line, len);
     buffer[len] = '\0';
 
     return len;
 }
+
+// Checks if a complete line is available, without blocking.
+bool Sodaq_GSM_Modem::pollLn(char*& line, size_t& len)
+{
+    // With a zero timeout the input buffer is checked just once
+    return readLnView(line, len, 0);
+}
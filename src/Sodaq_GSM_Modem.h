@@ -340,7 +340,15 @@ protected:
     bool _isBufferInitialized;
 
     // The buffer used when reading from the modem. The space is allocated during init() via initBuffer().
+    // The characters from _inputHead up to _inputTail have been read from the modem stream,
+    // but are not consumed yet. The buffer is compacted instead of wrapped around, so that
+    // a line is always contiguous and can be handed out without copying.
     char* _inputBuffer;
+    size_t _inputHead;
+    size_t _inputTail;
+
+    // The prompt handed out by readUntilView(), it is copied out of the input buffer
+    char _promptView[2];
 
     char * _apn;
     char * _apnUser;
@@ -382,6 +390,16 @@ protected:
     // Keep track when connect started. Use this to record various status changes.
     uint32_t _startOn;
 
+    // Counts the times the modem was switched on or off. The settings kept by the
+    // modem are lost when it changes.
+    uint16_t _powerCycleCount;
+
+    // Keep track when the most recent command was sent, to measure the response time.
+    uint32_t _commandSentAt;
+
+    // The most recent command has not had its (first) final response yet.
+    bool _commandOutstanding;
+
     // A call-back function to be called when the TCP is closed by the remote
     // Usually this comes in via URC's
     void (*_tcpClosedHandler)(void);
@@ -390,6 +408,12 @@ protected:
     // Safe to call multiple times.
     void initBuffer();
 
+    // Consumes up to the given terminator if it is in the input buffer, see readUntilView().
+    bool findInInputBuffer(char terminator, char*& view, size_t& len);
+
+    // Consumes a prompt if it is at the start of the input buffer, see readUntilView().
+    bool findPromptInInputBuffer(const char* prompts, char*& view, size_t& len);
+
     // Returns true if the modem is ON (and replies to "AT" commands without timing out)
     virtual bool isAlive() = 0;
 
@@ -401,8 +425,13 @@ protected:
     // Sets the modem stream.
     void setModemStream(Stream& stream);
 
+    // Moves the characters that are available on the modem stream into the input buffer,
+    // without blocking. Returns the number of characters in the input buffer that are
+    // not consumed yet.
+    size_t fillInputBuffer();
+
     // Returns a character from the modem stream if read within _timeout ms or -1 otherwise.
-    int timedRead(uint32_t timeout = 1000) const;
+    int timedRead(uint32_t timeout = 1000);
 
     // Fills the given "buffer" with characters read from the modem stream up to "length"
     // maximum characters and until the "terminator" character is found or a character read
@@ -416,6 +445,28 @@ protected:
     // Returns the number of characters written to the buffer.
     size_t readBytes(uint8_t* buffer, size_t length, uint32_t timeout = 1000);
 
+    // Fills the given "buffer" with up to "length" bytes, decoded from the hex string
+    // read from the modem stream. Like readBytes(), it stops when a character read
+    // times out. The hex text is decoded in the input buffer, it is not copied.
+    // Returns the number of bytes written to the buffer.
+    size_t readHexBytes(uint8_t* buffer, size_t length, uint32_t timeout = 1000);
+
+    // Reads from the modem stream until the "terminator" is found, or the timeout.
+    // On success "view" points to the characters in the input buffer (they are not copied)
+    // and "len" is the number of characters before the terminator. The terminator is
+    // replaced by null. If the input buffer fills up before the terminator is seen, the
+    // whole buffer is handed out.
+    // A prompt (one of the "prompts" characters, e.g. "@" or ">") is not followed by a
+    // terminator. If the input starts with one, the view holds just the prompt.
+    // The view is valid until the next read.
+    // Returns false on timeout, the characters read so far are kept for the next read.
+    bool readUntilView(char terminator, char*& view, size_t& len, uint32_t timeout = 1000,
+            const char* prompts = 0);
+
+    // Reads a line from the modem stream, just like readUntilView(). The line terminator is
+    // not part of the view.
+    bool readLnView(char*& line, size_t& len, uint32_t timeout = 1000, const char* prompts = 0);
+
     // Reads a line from the modem stream into the "buffer". The line terminator is not
     // written into the buffer. The buffer is terminated with null.
     // Returns the number of bytes read, not including the null terminator.
@@ -425,12 +476,20 @@ protected:
     // Returns the number of bytes read.
     size_t readLn() { return readLn(_inputBuffer, _inputBufferSize); };
 
+    // Checks if a complete line is available, without blocking. A partial line is kept
+    // until the next call.
+    // Returns true if a complete line was found, see readLnView() for "line" and "len".
+    bool pollLn(char*& line, size_t& len);
+
     // Write a byte
     size_t writeByte(uint8_t value);
 
     // Write the command prolog (just for debugging
     void writeProlog();
 
+    // Called by writeProlog() before a new command is written
+    virtual void beforeCommand() {}
+
     size_t print(const __FlashStringHelper *);
     size_t print(const String &);
     size_t print(const char[]);